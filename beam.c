@@ -0,0 +1,191 @@
+#include "beam.h"
+#include "segment.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*frames a beam can get ahead of the output before its oldest frame is committed regardless*/
+#define BEAM_DEPTH 64
+
+typedef struct{
+	seg_frames fr;//uncommitted frames in order
+	size_t bytes;//sum of outbuf_size over fr
+	uint64_t end;
+	double cost;//bytes per sample, what beams are ranked by
+} beam;
+
+static void beam_copy(beam *dst, beam *src){
+	if(dst->fr.alloc<src->fr.cnt+1){
+		dst->fr.alloc=src->fr.cnt+64;
+		dst->fr.frame=realloc(dst->fr.frame, sizeof(seg_frame)*dst->fr.alloc);
+	}
+	memcpy(dst->fr.frame, src->fr.frame, sizeof(seg_frame)*src->fr.cnt);
+	dst->fr.cnt=src->fr.cnt;
+	dst->bytes=src->bytes;
+	dst->end=src->end;
+}
+
+static int beam_cmp(const void *aa, const void *bb){
+	beam *a=(beam*)aa;
+	beam *b=(beam*)bb;
+	if(a->cost!=b->cost)
+		return a->cost<b->cost?-1:1;
+	return a->end>b->end?-1:(a->end<b->end?1:0);//prefer progress, ends are unique so this is a total order
+}
+
+/*Extend src by a frame into the next generation, a beam already ending at the same place is only replaced if worse*/
+static void beam_extend(beam *next, size_t *next_cnt, beam *src, uint64_t curr_sample, size_t sample_cnt, size_t outbuf_size){
+	size_t i;
+	for(i=0;i<*next_cnt;++i){
+		if(next[i].end==curr_sample+sample_cnt)
+			break;
+	}
+	if(i<*next_cnt && next[i].bytes<=src->bytes+outbuf_size)
+		return;
+	if(i==*next_cnt)
+		++*next_cnt;
+	beam_copy(next+i, src);
+	if(sample_cnt)
+		segment_add(&(next[i].fr), curr_sample, sample_cnt, outbuf_size);
+	next[i].bytes+=outbuf_size;
+	next[i].end=curr_sample+sample_cnt;
+}
+
+/*Commit frames every beam agrees on to the output queue*/
+static void beam_commit(beam *b, size_t cnt, queue *q, simple_enc **a, flac_settings *set, input *in, stats *stat, output *out){
+	size_t i, j, shared;
+	for(shared=0;shared<b[0].fr.cnt;++shared){
+		for(i=1;i<cnt;++i){
+			if(shared>=b[i].fr.cnt || b[i].fr.frame[shared].sample_cnt!=b[0].fr.frame[shared].sample_cnt)
+				break;
+		}
+		if(i!=cnt)
+			break;
+	}
+	for(j=0;j<shared;++j){
+		assert(b[0].fr.frame[j].curr_sample==in->loc_analysis);
+		(*a)->sample_cnt=b[0].fr.frame[j].sample_cnt;
+		(*a)->curr_sample=b[0].fr.frame[j].curr_sample;
+		(*a)->outbuf_size=b[0].fr.frame[j].outbuf_size;
+		*a=simple_enc_out(q, *a, set, in, stat, out);
+	}
+	if(!shared)
+		return;
+	for(i=0;i<cnt;++i){
+		for(j=0;j<shared;++j)
+			b[i].bytes-=b[i].fr.frame[j].outbuf_size;
+		memmove(b[i].fr.frame, b[i].fr.frame+shared, sizeof(seg_frame)*(b[i].fr.cnt-shared));
+		b[i].fr.cnt-=shared;
+	}
+}
+
+/*Candidate lengths for a beam ending at pos, the list plus whatever is left at eof. Returns count*/
+static size_t beam_candidates(flac_settings *set, uint64_t pos, uint64_t end, int eof, size_t *cand){
+	size_t i, r=0;
+	for(i=0;i<set->blocks_count;++i){
+		if(pos+set->blocks[i]<=end)
+			cand[r++]=set->blocks[i];
+	}
+	if(eof && end-pos<=(uint64_t)set->blocks[set->blocks_count-1] && end>pos && (!r || cand[r-1]!=end-pos))
+		cand[r++]=end-pos;
+	return r;
+}
+
+int beam_main(input *in, output *out, flac_settings *set){
+	clock_t cstart;
+	queue q;
+	stats stat={0};
+
+	beam *cur, *next, *swap, t;
+	simple_enc *a, *e;
+	spec_cache spec={0};
+	size_t *cand, cand_cnt, cur_cnt=1, i, j, k, lookahead, next_cnt;
+	uint64_t end, *ends;
+	int eof, live;
+
+	mode_boilerplate_init(set, &cstart, &q, &stat, in);
+
+	cur=calloc(set->beam*(set->blocks_count+1), sizeof(beam));
+	next=calloc(set->beam*(set->blocks_count+1), sizeof(beam));
+	cand=malloc(sizeof(size_t)*(set->blocks_count+1));
+	ends=malloc(sizeof(uint64_t)*set->beam);
+	a=calloc(1, sizeof(simple_enc));
+	lookahead=(BEAM_DEPTH+2)*set->blocks[set->blocks_count-1];
+	set->diff_comp_settings=set->diff_comp_settings?1:2;//hack as analysis not stored
+
+	cur[0].end=in->loc_analysis;
+	while(1){
+		in->input_read(in, lookahead);
+		eof=in->sample_cnt<lookahead;
+		end=in->loc_analysis+in->sample_cnt;
+
+		//every beam requests every candidate, beams that meet up share encodes through the cache
+		live=0;
+		for(i=0;i<cur_cnt;++i){
+			cand_cnt=beam_candidates(set, cur[i].end, end, eof, cand);
+			for(j=0;j<cand_cnt;++j)
+				spec_request(&spec, cur[i].end, cand[j]);
+			live|=cand_cnt?1:0;
+		}
+		if(!live)
+			break;
+		spec_run(&spec, set, in, &stat);
+
+		next_cnt=0;
+		for(i=0;i<cur_cnt;++i){
+			cand_cnt=beam_candidates(set, cur[i].end, end, eof, cand);
+			if(!cand_cnt)//finished at eof
+				beam_extend(next, &next_cnt, cur+i, cur[i].end, 0, 0);
+			for(j=0;j<cand_cnt;++j){
+				e=spec_peek(&spec, cur[i].end, cand[j]);
+				_if((!e), "beam failed to encode requested frame");
+				beam_extend(next, &next_cnt, cur+i, cur[i].end, cand[j], e->outbuf_size);
+			}
+		}
+		for(i=0;i<next_cnt;++i)
+			next[i].cost=((double)next[i].bytes)/(next[i].end-in->loc_analysis);
+		qsort(next, next_cnt, sizeof(beam), beam_cmp);
+		cur_cnt=next_cnt<(size_t)set->beam?next_cnt:(size_t)set->beam;
+		swap=cur;
+		cur=next;
+		next=swap;
+
+		//only encodes starting where a surviving beam ends can be used again
+		for(i=0;i<cur_cnt;++i)
+			ends[i]=cur[i].end;
+		spec_keep(&spec, ends, cur_cnt);
+
+		beam_commit(cur, cur_cnt, &q, &a, set, in, &stat, out);
+		if(cur[0].fr.cnt>BEAM_DEPTH){//beams haven't agreed for too long, follow the best
+			for(i=1, k=1;i<cur_cnt;++i){
+				if(cur[i].fr.frame[0].sample_cnt==cur[0].fr.frame[0].sample_cnt){
+					if(i!=k){//beams own their frame arrays, swap rather than overwrite
+						t=cur[k];
+						cur[k]=cur[i];
+						cur[i]=t;
+					}
+					++k;
+				}
+			}
+			cur_cnt=k;
+			beam_commit(cur, cur_cnt, &q, &a, set, in, &stat, out);
+		}
+	}
+	beam_commit(cur, 1, &q, &a, set, in, &stat, out);//only one beam can be finished at eof
+
+	mode_boilerplate_finish(set, &cstart, &q, &stat, in, out);
+	set->diff_comp_settings=set->diff_comp_settings==2?0:1;//reverse hack just in case
+
+	simple_enc_dealloc(a);
+	for(i=0;i<set->beam*(set->blocks_count+1);++i){
+		free(cur[i].fr.frame);
+		free(next[i].fr.frame);
+	}
+	free(cur);
+	free(next);
+	free(cand);
+	free(ends);
+	spec_dealloc(&spec);
+	return 0;
+}
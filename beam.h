@@ -0,0 +1,10 @@
+/*Beam mode implementation. Keeps the --beam best partial segmentations and advances them all a frame at a time,
+a middle ground between greedy gset and optimal peakset that works with any blocksize list*/
+#ifndef BEAM
+#define BEAM
+
+#include "common.h"
+
+int beam_main(input *in, output *out, flac_settings *set);
+
+#endif
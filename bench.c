@@ -0,0 +1,350 @@
+/* bench - Throughput and size benchmark for flaccid
+	* Generates reproducible synthetic signals as 16 bit wav (silence, tones, noise, transients and a
+	  music-like mix of 1/f noise and harmonic notes) over a few channel counts and sample rates
+	* Runs every mode plain, with merge/tweak and with its own options across worker counts through a
+	  flaccid binary, reading results back from --stats-json
+	* Prints one tab-separated row per run with bytes, wall time, samples/s, realtime factor and scaling
+	  efficiency relative to the 1 worker run of the same signal/mode/settings
+	* Checks output is byte-identical to the 1 worker run, exits non-zero if any run fails or differs
+	* -c does just that check quickly, short signals at every worker count up to 3 with no timing
+	* Only 16 bit signals as that's all wav input currently supports
+ */
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum{SIG_SILENCE, SIG_TONES, SIG_NOISE, SIG_TRANSIENTS, SIG_MUSIC};
+
+typedef struct{
+	char *name;
+	int signal, channels, rate;
+} bench_case;
+
+static const bench_case cases[]={
+	{"silence",    SIG_SILENCE,    2, 44100},
+	{"tones",      SIG_TONES,      2, 44100},
+	{"noise",      SIG_NOISE,      2, 44100},
+	{"transients", SIG_TRANSIENTS, 2, 44100},
+	{"music",      SIG_MUSIC,      2, 44100},
+	{"music-mono", SIG_MUSIC,      1, 8000},
+	{"music-96k",  SIG_MUSIC,      2, 96000},
+	{"music-5.1",  SIG_MUSIC,      6, 48000},
+};
+
+/*Inputs checked by -c beyond the matrix, ones that have broken a mode before and ones long enough for --segments to
+actually split. Written as raw CDDA when the path ends in .bin*/
+typedef struct{
+	char *file, *mode, *extra;
+	bench_case c;
+	uint64_t samples;
+} bench_regression;
+
+static const bench_regression regressions[]={
+	{"tail.bin", "gset", "--blocksize-list 4608 --segments 2", {"tail", SIG_MUSIC, 2, 44100}, (100*4608)+5},//eof segment tail just over blocks[0]
+	{"seg-gasc.wav", "gasc", "--segments 4", {"seg-gasc", SIG_MUSIC, 2, 44100}, (4*128*1536)+1000},
+	{"seg-gset.wav", "gset", "--segments 4 --screen 2", {"seg-gset", SIG_MUSIC, 2, 44100}, (4*128*4608)+1000},
+};
+
+/*Modes and the settings each is run with, NULL terminated. Fixed can't merge/tweak, the rest share the queue settings
+and add their own options. The small queue makes 1 second signals flush several times so overlap has an effect*/
+typedef struct{
+	char *mode;
+	char *extra[10];
+} bench_mode;
+
+#define BENCH_QUEUE "--merge 0 --tweak 0", "--merge 1 --tweak 1 --lax", "--outperc 70 --outputalt-comp 8p", "--resegment --merge 1 --tweak 1 --queue 16 --queue-overlap 4"
+
+static const bench_mode modes[]={
+	{"fixed",     {"", NULL}},
+	{"gasc",      {BENCH_QUEUE, "--segments 4", NULL}},
+	{"gset",      {BENCH_QUEUE, "--segments 4", "--screen 2", NULL}},
+	{"chunk",     {BENCH_QUEUE, NULL}},
+	{"peakset",   {BENCH_QUEUE, "--screen 2", "--peakset-coarse 0", "--peakset-coarse est", NULL}},
+	{"beam",      {BENCH_QUEUE, "--beam 1", "--beam 8", NULL}},
+	{"transient", {BENCH_QUEUE, "--transient-verify", NULL}},
+};
+
+static void _(char *s){
+	fprintf(stderr, "Error: %s\n", s);
+	exit(1);
+}
+
+static void _if(int goodbye, char *s){
+	if(goodbye)
+		_(s);
+}
+
+//xorshift64*, so signals are identical everywhere
+static uint64_t rng_state;
+
+static uint64_t rng(void){
+	rng_state^=rng_state>>12;
+	rng_state^=rng_state<<25;
+	rng_state^=rng_state>>27;
+	return rng_state*2685821657736338717ULL;
+}
+
+static double rng_unit(void){//[-1, 1)
+	return ((double)(rng()>>11)/(double)(1ULL<<52))-1.0;
+}
+
+static void put_u16(FILE *f, uint16_t v){
+	fputc(v&255, f);
+	fputc(v>>8, f);
+}
+
+static void put_u32(FILE *f, uint32_t v){
+	put_u16(f, v&65535);
+	put_u16(f, v>>16);
+}
+
+/*Write frames samples of a signal as 16 bit wav, or raw if raw is set*/
+static void bench_generate(const char *path, const bench_case *c, uint64_t frames, int raw){
+	FILE *f;
+	double amp, env=0, freq[4], phase[4]={0}, pink[6]={0}, s, t;
+	int ch, i, k, note=0;
+	uint64_t n;
+	int16_t v;
+
+	f=fopen(path, "wb");
+	_if((!f), "Could not create signal file");
+	if(!raw){//wav header
+		fwrite("RIFF", 1, 4, f);
+		put_u32(f, 36+frames*c->channels*2);
+		fwrite("WAVEfmt ", 1, 8, f);
+		put_u32(f, 16);
+		put_u16(f, 1);
+		put_u16(f, c->channels);
+		put_u32(f, c->rate);
+		put_u32(f, c->rate*c->channels*2);
+		put_u16(f, c->channels*2);
+		put_u16(f, 16);
+		fwrite("data", 1, 4, f);
+		put_u32(f, frames*c->channels*2);
+	}
+
+	rng_state=0x9E3779B97F4A7C15ULL^c->signal;
+	for(i=0;i<4;++i)
+		freq[i]=110.0*(i+1)*1.5;
+	for(n=0;n<frames;++n){
+		t=((double)n)/c->rate;
+		if(c->signal==SIG_MUSIC && n%(c->rate/4)==0 && rng()%3==0){//new note every so often
+			note=rng()%24;
+			env=1.0;
+			for(i=0;i<4;++i)
+				freq[i]=110.0*pow(2.0, note/12.0)*(i+1);
+		}
+		if(c->signal==SIG_TRANSIENTS && rng()%(c->rate/3)==0)
+			env=1.0;
+		for(ch=0;ch<c->channels;++ch){
+			switch(c->signal){
+				case SIG_SILENCE:
+					s=0;
+					break;
+				case SIG_TONES:
+					s=0.3*sin(2*M_PI*440*t+ch)+0.2*sin(2*M_PI*(660+5*sin(2*M_PI*0.5*t))*t)+0.1*sin(2*M_PI*3520*t);
+					break;
+				case SIG_NOISE:
+					s=0.25*rng_unit();
+					break;
+				case SIG_TRANSIENTS:
+					s=0.05*sin(2*M_PI*220*t)+0.8*env*rng_unit();
+					break;
+				default://music, 1/f noise bed under harmonic notes
+					for(k=0, amp=0;k<6;++k){
+						pink[k]=pink[k]*(1.0-1.0/(1<<(2*k)))+rng_unit()/(1<<(2*k));
+						amp+=pink[k];
+					}
+					s=0.05*amp;
+					for(i=0;i<4;++i)
+						s+=(0.3/(i+1))*env*sin(phase[i]+ch*0.1);
+					break;
+			}
+			s=s>1?1:(s<-1?-1:s);
+			v=(int16_t)(s*32767);
+			put_u16(f, (uint16_t)v);
+		}
+		for(i=0;i<4;++i)
+			phase[i]+=2*M_PI*freq[i]/c->rate;
+		env*=c->signal==SIG_TRANSIENTS?0.999:0.99995;
+	}
+	fclose(f);
+}
+
+/*Worker count after w. -c runs every count up to max_workers, otherwise counts double from 1 and always end on
+max_workers. Past max_workers when done*/
+static int next_workers(int w, int max_workers, int check){
+	if(check || w==max_workers)
+		return w+1;
+	return (w*2<max_workers)?w*2:max_workers;
+}
+
+/*Pull a number out of the stats json by key, good enough for the flat fields we need*/
+static double json_number(const char *json, const char *key){
+	char pat[64];
+	const char *p;
+	snprintf(pat, sizeof(pat), "\"%s\":", key);
+	p=strstr(json, pat);
+	_if((!p), "Key missing from --stats-json output");
+	return atof(p+strlen(pat));
+}
+
+/*Whether two files have the same contents*/
+static int same_file(const char *a, const char *b){
+	FILE *fa, *fb;
+	int ca, cb, r=0;
+	fa=fopen(a, "rb");
+	fb=fopen(b, "rb");
+	if(fa && fb){
+		do{
+			ca=fgetc(fa);
+			cb=fgetc(fb);
+		}while(ca==cb && ca!=EOF);
+		r=(ca==cb);
+	}
+	if(fa)
+		fclose(fa);
+	if(fb)
+		fclose(fb);
+	return r;
+}
+
+/*Run flaccid once, returns 0 on failure*/
+static int bench_run(const char *flaccid, const char *dir, const char *in, const char *mode, const char *extra, int workers, double *bytes, double *wall){
+	char cmd[4096], json[1<<16], path[1024];
+	FILE *f;
+	size_t len;
+	snprintf(path, sizeof(path), "%s/bench.json", dir);
+	snprintf(cmd, sizeof(cmd), "%s --in %s --out %s/bench.flac --mode %s --workers %d %s --stats-json %s 2>/dev/null", flaccid, in, dir, mode, workers, extra, path);
+	remove(path);
+	if(system(cmd)!=0)
+		return 0;
+	f=fopen(path, "rb");
+	if(!f)
+		return 0;
+	len=fread(json, 1, sizeof(json)-1, f);
+	json[len]=0;
+	fclose(f);
+	*bytes=json_number(json, "size");
+	*wall=json_number(json, "wall_time");
+	return 1;
+}
+
+int main(int argc, char *argv[]){
+	char *dir="/tmp", *extra, *flaccid="./flaccid", in[1024], out[1024], ref[1024];
+	double base, bytes, sps, wall;
+	int check=0, e, failed=0, have_ref, identical, max_workers=0, mismatch=0, opt, seconds=0, w;
+	size_t c, m;
+
+	while((opt=getopt(argc, argv, "cf:d:s:w:h"))!=-1){
+		switch(opt){
+			case 'c':
+				check=1;
+				break;
+			case 'f':
+				flaccid=optarg;
+				break;
+			case 'd':
+				dir=optarg;
+				break;
+			case 's':
+				seconds=atoi(optarg);
+				_if((seconds<1), "Invalid -s");
+				break;
+			case 'w':
+				max_workers=atoi(optarg);
+				_if((max_workers<1), "Invalid -w");
+				break;
+			default:
+				return printf("Usage: bench [-c] [-f flaccid] [-d tmpdir] [-s seconds] [-w max_workers]\n"
+				"Runs every mode over synthetic signals at 1, 2, 4.. workers and max_workers (default all cores)\n"
+				" -c : Quick determinism check instead, 1 second signals at every worker count up to max_workers\n"
+				"      (default 3) without timing. Exits non-zero if any run fails or output differs\n");
+		}
+	}
+	if(!seconds)
+		seconds=check?1:20;
+	if(!max_workers)
+		max_workers=check?3:sysconf(_SC_NPROCESSORS_ONLN);
+
+	snprintf(out, sizeof(out), "%s/bench.flac", dir);
+	snprintf(ref, sizeof(ref), "%s/bench_ref.flac", dir);
+	if(check)
+		printf("signal\tchannels\trate\tmode\tsettings\tworkers\tbytes\tidentical\n");
+	else
+		printf("signal\tchannels\trate\tmode\tsettings\tworkers\tbytes\twall\tsamples_per_sec\trealtime\tscaling\tidentical\n");
+	for(c=0;c<sizeof(cases)/sizeof(cases[0]);++c){
+		snprintf(in, sizeof(in), "%s/bench_%s.wav", dir, cases[c].name);
+		bench_generate(in, cases+c, ((uint64_t)seconds)*cases[c].rate, 0);
+		for(m=0;m<sizeof(modes)/sizeof(modes[0]);++m){
+			for(e=0;modes[m].extra[e];++e){
+				extra=modes[m].extra[e];
+				base=0;
+				have_ref=0;
+				remove(ref);
+				for(w=1;w<=max_workers;w=next_workers(w, max_workers, check)){
+					if(!bench_run(flaccid, dir, in, modes[m].mode, extra, w, &bytes, &wall)){
+						printf("%s\t%d\t%d\t%s\t%s\t%d\tFAIL\n", cases[c].name, cases[c].channels, cases[c].rate, modes[m].mode, extra[0]?extra:"-", w);
+						fflush(stdout);
+						++failed;
+						if(w==1)
+							break;//nothing to compare against
+						continue;
+					}
+					sps=wall>0?(((double)seconds)*cases[c].rate)/wall:0;
+					if(w==1){
+						base=sps;
+						have_ref=identical=(rename(out, ref)==0);
+						failed+=!have_ref;
+					}
+					else{
+						identical=have_ref && same_file(out, ref);
+						mismatch+=!identical;
+					}
+					if(check)
+						printf("%s\t%d\t%d\t%s\t%s\t%d\t%.0f\t%s\n", cases[c].name, cases[c].channels, cases[c].rate, modes[m].mode, extra[0]?extra:"-", w, bytes, identical?"yes":"NO");
+					else
+						printf("%s\t%d\t%d\t%s\t%s\t%d\t%.0f\t%.3f\t%.0f\t%.1f\t%.2f\t%s\n", cases[c].name, cases[c].channels, cases[c].rate, modes[m].mode, extra[0]?extra:"-", w, bytes, wall, sps, sps/cases[c].rate, base>0?sps/(base*w):0, identical?"yes":"NO");
+					fflush(stdout);
+				}
+			}
+		}
+		remove(in);
+	}
+	for(c=0;check && c<sizeof(regressions)/sizeof(regressions[0]);++c){
+		snprintf(in, sizeof(in), "%s/bench_%s", dir, regressions[c].file);
+		bench_generate(in, &(regressions[c].c), regressions[c].samples, strstr(regressions[c].file, ".bin")!=NULL);
+		have_ref=0;
+		remove(ref);
+		for(w=1;w<=max_workers;w=next_workers(w, max_workers, 1)){
+			if(!bench_run(flaccid, dir, in, regressions[c].mode, regressions[c].extra, w, &bytes, &wall)){
+				printf("%s\t%d\t%d\t%s\t%s\t%d\tFAIL\n", regressions[c].file, regressions[c].c.channels, regressions[c].c.rate, regressions[c].mode, regressions[c].extra, w);
+				++failed;
+				if(w==1)
+					break;
+				continue;
+			}
+			if(w==1){
+				have_ref=identical=(rename(out, ref)==0);
+				failed+=!have_ref;
+			}
+			else{
+				identical=have_ref && same_file(out, ref);
+				mismatch+=!identical;
+			}
+			printf("%s\t%d\t%d\t%s\t%s\t%d\t%.0f\t%s\n", regressions[c].file, regressions[c].c.channels, regressions[c].c.rate, regressions[c].mode, regressions[c].extra, w, bytes, identical?"yes":"NO");
+			fflush(stdout);
+		}
+		remove(in);
+	}
+	remove(out);
+	remove(ref);
+	if(failed)
+		fprintf(stderr, "%d runs failed\n", failed);
+	if(mismatch)
+		fprintf(stderr, "%d runs differ from the 1 worker output\n", mismatch);
+	return (failed||mismatch)?1:0;
+}
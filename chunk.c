@@ -43,6 +43,15 @@ static size_t chunk_analyse(chenc *c){
 	}
 }
 
+// Log every frame in the tree for --decision-log, start is where the root begins
+static void chunk_log(chenc *c, flac_settings *set, uint64_t start){
+	decision_log(set, "chunk", c->use_this?1:0, start+c->offset, c->enc->sample_cnt, c->enc->outbuf_size);
+	if(c->l)
+		chunk_log(c->l, set, start);
+	if(c->r)
+		chunk_log(c->r, set, start);
+}
+
 // Write best combination of frames in correct order
 static void chunk_write(chenc *c, queue *q, flac_settings *set, input *in, stats *stat, output *out){
 	if(c->use_this)
@@ -55,24 +64,9 @@ static void chunk_write(chenc *c, queue *q, flac_settings *set, input *in, stats
 	}
 }
 
-int chunk_main(input *in, output *out, flac_settings *set){
-	clock_t cstart;
-	queue q;
-	stats stat={0};
-
-	chenc *encoder;
-	size_t i, child_index, curr_blocksize, curr_offset, encoder_cnt=2, parent_index;
-
-	mode_boilerplate_init(set, &cstart, &q, &stat);
-
-	for(i=1;i<set->blocks_count;++i){
-		_if((set->blocks[i-1]*2!=set->blocks[i]), "Chunk mode requires blocksizes to be a multiple of two from each other");
-		encoder_cnt*=2;
-	}
-	--encoder_cnt;
-	encoder=calloc(encoder_cnt, sizeof(chenc));
-
-	//build working data
+//Build the tree for one root chunk in a contiguous array, offsets are relative to the root
+static void chunk_build(chenc *encoder, size_t encoder_cnt, flac_settings *set){
+	size_t i, child_index, curr_blocksize, curr_offset, parent_index;
 	parent_index=0;
 	child_index=1;
 	curr_blocksize=set->blocks[set->blocks_count-1];
@@ -99,22 +93,56 @@ int chunk_main(input *in, output *out, flac_settings *set){
 			curr_offset+=curr_blocksize;
 		}
 	}
+}
+
+int chunk_main(input *in, output *out, flac_settings *set){
+	clock_t cstart;
+	queue q;
+	stats stat={0};
+
+	chenc *encoder;
+	double tr;
+	size_t i, encoder_cnt=2, root_size, roots, roots_max;
 
-	in->input_read(in, set->blocks[set->blocks_count-1]);
-	while(!simple_enc_eof(&q, &(encoder[0].enc), set, in, set->blocks[set->blocks_count-1], &stat, out)){//if enough input, chunk
-		#pragma omp parallel for num_threads(set->work_count)
-		for(i=0;i<encoder_cnt;++i){//encode using array for easy multithreading
-			simple_enc_analyse(encoder[i].enc, set, in, encoder[i].blocksize, in->loc_analysis+encoder[i].offset, &stat);
+	mode_boilerplate_init(set, &cstart, &q, &stat, in);
+
+	for(i=1;i<set->blocks_count;++i){
+		_if((set->blocks[i-1]*2!=set->blocks[i]), "Chunk mode requires blocksizes to be a multiple of two from each other");
+		encoder_cnt*=2;
+	}
+	--encoder_cnt;
+	root_size=set->blocks[set->blocks_count-1];
+
+	//roots are independent so batch enough of them to keep every worker busy through a single parallel region
+	roots_max=((2*set->work_count)+encoder_cnt-1)/encoder_cnt;
+	encoder=calloc(encoder_cnt*roots_max, sizeof(chenc));
+
+	//build working data
+	for(i=0;i<roots_max;++i)
+		chunk_build(encoder+(i*encoder_cnt), encoder_cnt, set);
+
+	in->input_read(in, root_size*roots_max);
+	while(!simple_enc_eof(&q, &(encoder[0].enc), set, in, root_size, &stat, out)){//if enough input, chunk
+		roots=in->sample_cnt/root_size;
+		roots=roots>roots_max?roots_max:roots;
+		tr=trace_now(set->trace);
+		#pragma omp parallel for num_threads(set->work_count) schedule(dynamic)
+		for(i=0;i<roots*encoder_cnt;++i){//encode using array for easy multithreading
+			simple_enc_analyse(encoder[i].enc, set, in, encoder[i].blocksize, in->loc_analysis+((i/encoder_cnt)*root_size)+encoder[i].offset, &stat);
 		}
 		#pragma omp barrier
-		chunk_analyse(encoder);
-		chunk_write(encoder, &q, set, in, &stat, out);
-		in->input_read(in, set->blocks[set->blocks_count-1]);
+		trace_barrier(set->trace, tr);
+		for(i=0;i<roots;++i){
+			chunk_analyse(encoder+(i*encoder_cnt));
+			chunk_log(encoder+(i*encoder_cnt), set, in->loc_analysis);
+			chunk_write(encoder+(i*encoder_cnt), &q, set, in, &stat, out);
+		}
+		in->input_read(in, root_size*roots_max);
 	}
 
 	mode_boilerplate_finish(set, &cstart, &q, &stat, in, out);
 
-	for(i=0;i<encoder_cnt;++i)
+	for(i=0;i<encoder_cnt*roots_max;++i)
 		simple_enc_dealloc(encoder[i].enc);
 	free(encoder);
 	return 0;
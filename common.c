@@ -1,4 +1,5 @@
 #include "common.h"
+#include "report.h"
 #include "seektable.h"
 
 #include <assert.h>
@@ -96,12 +97,34 @@ FLAC__StaticEncoder *init_static_encoder(flac_settings *set, int blocksize, char
 	return r;
 }
 
+char *mode_name(int mode){
+	char *modes[]={"chunk", "gset", "peakset", "gasc", "fixed", "transient", "beam"};
+	return modes[mode];
+}
+
+char *phase_name(int phase){
+	char *phases[]={"read", "md5", "analysis", "resegment", "merge", "tweak", "output", "write"};
+	return phases[phase];
+}
+
+void decision_log(flac_settings *set, const char *source, int chosen, uint64_t curr_sample, size_t samples, size_t bytes){
+	if(!set->decision_log)
+		return;
+	#pragma omp critical(decision_log)
+	fprintf(set->decision_log, "%s,%s,%"PRIu64",%zu,%zu\n", source, chosen?"chosen":"rejected", curr_sample, samples, bytes);
+}
+
 void print_settings(flac_settings *set){
-	char *modes[]={"chunk", "gset", "peakset", "gasc", "fixed"};
 	int i;
-	fprintf(stderr, "settings\tmode(%s);lax(%u);analysis_comp(%s);analysis_apod(%s);output_comp(%s);output_apod(%s);tweak(%u);merge(%u);", modes[set->mode], set->lax, set->comp_anal, set->apod_anal, set->comp_output, set->apod_output, set->tweak, set->merge);
+	fprintf(stderr, "settings\tmode(%s);lax(%u);analysis_comp(%s);analysis_apod(%s);output_comp(%s);output_apod(%s);tweak(%u);merge(%u);", mode_name(set->mode), set->lax, set->comp_anal, set->apod_anal, set->comp_output, set->apod_output, set->tweak, set->merge);
+	if(set->merge)
+		fprintf(stderr, "merge_span(%u);", set->merge_span);
+	if(set->resegment)
+		fprintf(stderr, "resegment(1);");
+	if(set->queue_overlap)
+		fprintf(stderr, "queue_overlap(%u);", set->queue_overlap);
 
-	if(set->merge||set->tweak||set->mode==3)
+	if(set->merge||set->tweak||set->resegment||set->mode==3)
 		fprintf(stderr, "blocksize_limit_lower(%u);blocksize_limit_upper(%u)", set->blocksize_limit_lower, set->blocksize_limit_upper);
 
 	if(set->outperc!=100)
@@ -112,39 +135,134 @@ void print_settings(flac_settings *set){
 			fprintf(stderr, ",%u", set->blocks[i]);
 		fprintf(stderr, ")");
 	}
+	if(set->screen)
+		fprintf(stderr, ";screen(%u)", set->screen);
+	if(set->segments>1)
+		fprintf(stderr, ";segments(%u)", set->segments);
+	if(set->comp_coarse && set->mode==MODE_PEAKSET)
+		fprintf(stderr, ";peakset_coarse(%s);peakset_tolerance(%u)", set->comp_coarse, set->coarse_tol);
+	if(set->mode==MODE_BEAM)
+		fprintf(stderr, ";beam(%u)", set->beam);
+	if(set->mode==MODE_TRANSIENT)
+		fprintf(stderr, ";transient_db(%u);transient_verify(%u)", set->transient_db, set->transient_verify);
 }
 
-void print_stats(stats *stat, input *in, size_t outsize){
-	uint64_t anal=0, out=0, tweak=0, merge=0, i;
+size_t blocksize_gcd(flac_settings *set){
+	size_t a, b, i, r=set->blocks[0], t;
+	for(i=1;i<set->blocks_count;++i){
+		a=r;
+		b=set->blocks[i];
+		while(b){
+			t=a%b;
+			a=b;
+			b=t;
+		}
+		r=a;
+	}
+	return r;
+}
+
+void stats_total(stats *stat, thread_stats *tot){
+	size_t i, j;
+	uint64_t *sum=(uint64_t*)tot, *add;
+	memset(tot, 0, sizeof(thread_stats));
 	for(i=0;i<stat->work_count;++i){
-		anal+=stat->effort_anal[i];
-		out+=stat->effort_output[i];
-		tweak+=stat->effort_tweak[i];
-		merge+=stat->effort_merge[i];
+		add=(uint64_t*)(stat->thread+i);
+		for(j=0;j<sizeof(thread_stats)/sizeof(uint64_t);++j)
+			sum[j]+=add[j];
 	}
-	fprintf(stderr, "\teffort\tanalysis(%.3f);tweak(%.3f);merge(%.3f);output(%.3f)", ((double)anal)/in->loc_analysis, ((double)tweak)/in->loc_analysis, ((double)merge)/in->loc_analysis, ((double)out)/in->loc_analysis);
+}
+
+void print_stats(stats *stat, input *in, size_t outsize){
+	thread_stats tot;
+	size_t j;
+	uint64_t busiest, i;
+	double wall;
+	stats_total(stat, &tot);
+	fprintf(stderr, "\teffort\tanalysis(%.3f);tweak(%.3f);merge(%.3f);output(%.3f)", ((double)tot.effort_anal)/in->loc_analysis, ((double)tot.effort_tweak)/in->loc_analysis, ((double)tot.effort_merge)/in->loc_analysis, ((double)tot.effort_output)/in->loc_analysis);
+	if(tot.effort_reseg)
+		fprintf(stderr, ";resegment(%.3f)", ((double)tot.effort_reseg)/in->loc_analysis);
 	fprintf(stderr, "\tsize\t%zu\tcpu_time\t%.5f", outsize, stat->cpu_time);
+
+	//wall/cpu summed over threads/cpu of the busiest thread in seconds, samples per wall second and realtime factor
+	fprintf(stderr, "\twall_time\t%.5f\tphases\t", stat->wall_time);
+	for(i=0;i<PHASE_COUNT;++i){
+		wall=stat->phase_wall[i];
+		for(j=0, busiest=0;j<stat->work_count;++j)
+			busiest=stat->thread[j].phase_cpu[i]>busiest?stat->thread[j].phase_cpu[i]:busiest;
+		fprintf(stderr, "%s%s(%.3f/%.3f/%.3f,%.0f,%.1fx)", i?";":"", phase_name(i), wall, tot.phase_cpu[i]/1e9, busiest/1e9, wall>0?in->loc_analysis/wall:0, wall>0?(((double)in->loc_analysis)/in->set->sample_rate)/wall:0);
+	}
+}
+
+/*Add the cpu time every worker has used since it was last sampled to phase, PHASE_COUNT only takes the marks. Each
+worker's own CLOCK_THREAD_CPUTIME_ID is read through the clock id it registered, so workers aren't woken to do it*/
+static void phase_sample(stats *stat, int phase){
+	struct timespec t;
+	size_t i;
+	uint64_t now;
+	for(i=0;i<stat->work_count;++i){
+		clock_gettime(stat->thread_clock[i], &t);
+		now=(((uint64_t)t.tv_sec)*1000000000)+t.tv_nsec;
+		if(phase<PHASE_COUNT)
+			stat->thread[i].phase_cpu[phase]+=now-stat->thread_mark[i];
+		stat->thread_mark[i]=now;
+	}
+}
+
+/*Each worker registers the clock id of its CLOCK_THREAD_CPUTIME_ID. The team is reused by every parallel region
+with work_count threads, so worker i stays the same thread*/
+void phase_begin(stats *stat){
+	if(!stat)
+		return;
+	if(!stat->thread_clock){
+		stat->thread_clock=malloc(sizeof(clockid_t)*stat->work_count);
+		stat->thread_mark=malloc(sizeof(uint64_t)*stat->work_count);
+		#pragma omp parallel num_threads(stat->work_count)
+		pthread_getcpuclockid(pthread_self(), stat->thread_clock+omp_get_thread_num());
+	}
+	stat->mark_wall=omp_get_wtime();
+	phase_sample(stat, PHASE_COUNT);
+}
+
+void phase_end(stats *stat, int phase){
+	double wall;
+	if(!stat)
+		return;
+	wall=omp_get_wtime();
+	stat->phase_wall[phase]+=wall-stat->mark_wall;
+	stat->mark_wall=wall;
+	phase_sample(stat, phase);
 }
 
 static void simple_enc_encode(simple_enc *senc, flac_settings *set, input *in, uint32_t samples, uint64_t curr_sample, int is_anal, stats *stat){
+	char *kind[]={"output encode", "analysis encode", "outputalt encode", "coarse encode"};
+	double tr=trace_now(set->trace);
 	assert(senc&&set&&in);
 	assert(samples);
 	if(senc->enc)
 		FLAC__static_encoder_delete(senc->enc);
-	senc->enc=init_static_encoder(set, set->mode==4?set->blocks[0]:(samples<16?16:samples), is_anal==1?set->comp_anal:(is_anal==0?set->comp_output:set->comp_outputalt), is_anal==1?set->apod_anal:(is_anal==0?set->apod_output:set->apod_outputalt));
+	senc->enc=init_static_encoder(set, set->mode==4?set->blocks[0]:(samples<16?16:(int)samples), is_anal==1?set->comp_anal:(is_anal==0?set->comp_output:(is_anal==3?set->comp_coarse:set->comp_outputalt)), (is_anal==1||is_anal==3)?set->apod_anal:(is_anal==0?set->apod_output:set->apod_outputalt));
 	senc->sample_cnt=samples;
 	senc->curr_sample=curr_sample;
 	set->encode_func(senc->enc, ((uint8_t*)in->buf)+((curr_sample-in->loc_buffer)*set->channels*(set->bps==16?2:4)), samples, curr_sample, &(senc->outbuf), &(senc->outbuf_size));//do encode
-	if(stat&&(is_anal==1))
-		stat->effort_anal[omp_get_thread_num()]+=samples;
-	else if(stat)
-		stat->effort_output[omp_get_thread_num()]+=samples;
+	if(stat){
+		if(is_anal==1||is_anal==3)
+			stat->thread[omp_get_thread_num()].effort_anal+=samples;
+		else
+			stat->thread[omp_get_thread_num()].effort_output+=samples;
+		++stat->thread[omp_get_thread_num()].encodes;
+	}
+	trace_add(set->trace, kind[is_anal], tr, curr_sample, samples);
 }
 
 void simple_enc_analyse(simple_enc *senc, flac_settings *set, input *in, uint32_t samples, uint64_t curr_sample, stats *stat){
 	simple_enc_encode(senc, set, in, samples, curr_sample, 1, stat);
 }
 
+void simple_enc_coarse(simple_enc *senc, flac_settings *set, input *in, uint32_t samples, uint64_t curr_sample, stats *stat){
+	simple_enc_encode(senc, set, in, samples, curr_sample, 3, stat);
+}
+
 int simple_enc_eof(queue *q, simple_enc **senc, flac_settings *set, input *in, uint64_t threshold, stats *stat, output *out){
 	if(in->sample_cnt<threshold){//EOF
 		if(in->sample_cnt){
@@ -161,174 +279,489 @@ void simple_enc_dealloc(simple_enc *senc){
 	free(senc);
 }
 
-static size_t qmerge(queue *q, flac_settings *set, input *in, stats *stat, int i, size_t *saved){
-	simple_enc *a;
-	if(!(q->sq[i]->sample_cnt) || !(q->sq[i+1]->sample_cnt))
-		return 0;
-	if((q->sq[i]->sample_cnt+q->sq[i+1]->sample_cnt)>set->blocksize_limit_upper)
-		return 0;
-	a=calloc(1, sizeof(simple_enc));
-	stat->effort_merge[omp_get_thread_num()]+=q->sq[i]->sample_cnt+q->sq[i+1]->sample_cnt;
-	simple_enc_analyse(a, set, in, q->sq[i]->sample_cnt+q->sq[i+1]->sample_cnt, q->sq[i]->curr_sample, NULL);
-	if(a->outbuf_size<(q->sq[i]->outbuf_size+q->sq[i+1]->outbuf_size)){
-		(*saved)+=(q->sq[i]->outbuf_size+q->sq[i+1]->outbuf_size) - a->outbuf_size;
-		FLAC__static_encoder_delete(q->sq[i+1]->enc);//simple_enc only deletes previous if sample_cnt>0, and we're manually messing with that
-		q->sq[i+1]->enc=NULL;
-		q->sq[i+1]->sample_cnt=0;
-		simple_enc_dealloc(q->sq[i]);
-		q->sq[i]=a;
-		return 1;
+/*Add the bytes saved by a merge/tweak pass to the per pass totals*/
+static void pass_saved(uint64_t **saved, size_t *passes, size_t pass, size_t bytes){
+	if(pass>=*passes){
+		*saved=realloc(*saved, sizeof(uint64_t)*(pass+1));
+		for(;*passes<=pass;++*passes)
+			(*saved)[*passes]=0;
+	}
+	(*saved)[pass]+=bytes;
+}
+
+/*Whether any of the k frames from i changed in or after pass since*/
+static int qdirty(queue *q, size_t i, size_t k, size_t since){
+	size_t j;
+	for(j=i;j<i+k;++j){
+		if(q->sq[j]->gen>=since)
+			return 1;
 	}
-	simple_enc_dealloc(a);
 	return 0;
 }
 
-static int senc_comp_merge(const void *aa, const void *bb){
-	simple_enc *a=*(simple_enc**)aa;
-	simple_enc *b=*(simple_enc**)bb;
-	if(!a->sample_cnt)
-		return 1;
-	if(!b->sample_cnt)
-		return -1;
-	return (a->curr_sample<b->curr_sample)?-1:1;
+/*Encode k frames from i merged, keeping the encode only if it's smaller than the frames were*/
+static simple_enc *qmerge(queue *q, flac_settings *set, input *in, stats *stat, size_t i, size_t k){
+	simple_enc *a;
+	size_t j, samples=0, size=0;
+	for(j=i;j<i+k;++j){
+		samples+=q->sq[j]->sample_cnt;
+		size+=q->sq[j]->outbuf_size;
+	}
+	if(samples>(size_t)set->blocksize_limit_upper)
+		return NULL;
+	a=calloc(1, sizeof(simple_enc));
+	stat->thread[omp_get_thread_num()].effort_merge+=samples;
+	++stat->thread[omp_get_thread_num()].encodes;
+	simple_enc_analyse(a, set, in, samples, q->sq[i]->curr_sample, NULL);
+	if(a->outbuf_size<size)
+		return a;
+	decision_log(set, "merge", 0, a->curr_sample, a->sample_cnt, a->outbuf_size);
+	simple_enc_dealloc(a);
+	return NULL;
 }
 
-/*Do merge passes on queue*/
-static void queue_merge(queue *q, flac_settings *set, input *in, stats *stat){
-	size_t i, ind=0, saved_bytes, saved_frames;
-	if(!set->merge)
+/*Do merge passes on queue. Every run of 2 to merge_span adjacent frames is tried in one parallel phase, then a linear
+DP over the queue picks the set of non-overlapping merges that saves the most. After the first pass only runs
+touching a frame the previous pass changed are tried, the rest would encode the same as last time. The first pass
+skips runs entirely within frames held over from the last flush*/
+void queue_merge(queue *q, flac_settings *set, input *in, stats *stat, size_t since){
+	simple_enc **cand, *swap;
+	double pass, tr;
+	size_t c, *gain, i, ind=0, j, k, saved_bytes, saved_frames, span=set->merge_span-1, *total, *used;
+	if(!set->merge || q->depth<2)
 		return;
+	//cand[(i*span)+k-2] is frames i..i+k-1 merged
+	cand=malloc(sizeof(simple_enc*)*q->depth*span);
+	gain=malloc(sizeof(size_t)*q->depth*span);
+	total=malloc(sizeof(size_t)*(q->depth+1));
+	used=malloc(sizeof(size_t)*(q->depth+1));
 	do{
-		for(i=0;i<set->work_count;++i){
-			q->cnt[i]=0;
-			q->saved[i]=0;
-		}
-
-		#pragma omp parallel for num_threads(set->work_count)
-		for(i=0;i<q->depth/2;++i){//even pairs
-			q->cnt[omp_get_thread_num()]+=qmerge(q, set, in, stat, 2*i, &(q->saved[omp_get_thread_num()]));
+		++q->gen;
+		pass=trace_now(set->trace);
+		tr=pass;
+		#pragma omp parallel for num_threads(set->work_count) schedule(dynamic) private(i, k, j)
+		for(c=0;c<q->depth*span;++c){
+			i=c/span;
+			k=(c%span)+2;
+			cand[c]=(i+k<=q->depth && qdirty(q, i, k, since))?qmerge(q, set, in, stat, i, k):NULL;
+			gain[c]=0;
+			if(cand[c]){
+				for(j=i;j<i+k;++j)
+					gain[c]+=q->sq[j]->outbuf_size;
+				gain[c]-=cand[c]->outbuf_size;
+			}
 		}
 		#pragma omp barrier
-
-		#pragma omp parallel for num_threads(set->work_count)
-		for(i=0;i<(q->depth-1)/2;++i){//odd pairs
-			q->cnt[omp_get_thread_num()]+=qmerge(q, set, in, stat, (2*i)+1, &(q->saved[omp_get_thread_num()]));
+		trace_barrier(set->trace, tr);
+
+		//total[n] is the best saving using merges entirely within the first n frames, used[n] the frame count of the last
+		total[0]=0;
+		for(i=1;i<=q->depth;++i){
+			total[i]=total[i-1];
+			used[i]=1;
+			for(k=2;k<=(size_t)set->merge_span && k<=i;++k){
+				c=((i-k)*span)+k-2;
+				if(cand[c] && total[i-k]+gain[c]>total[i]){
+					total[i]=total[i-k]+gain[c];
+					used[i]=k;
+				}
+			}
 		}
-		#pragma omp barrier
 
-		//gather stats
-		for(i=0, saved_bytes=0, saved_frames=0;i<set->work_count;++i){
-			saved_bytes+=q->saved[i];
-			saved_frames+=q->cnt[i];
+		//walk back applying merges, a merge leaves empty instances in all but its first slot
+		saved_bytes=total[q->depth];
+		saved_frames=0;
+		for(i=q->depth;i;i-=used[i]){
+			if(used[i]==1)
+				continue;
+			c=((i-used[i])*span)+used[i]-2;
+			decision_log(set, "merge", 1, cand[c]->curr_sample, cand[c]->sample_cnt, cand[c]->outbuf_size);
+			simple_enc_dealloc(q->sq[i-used[i]]);
+			q->sq[i-used[i]]=cand[c];
+			q->sq[i-used[i]]->gen=q->gen;
+			cand[c]=NULL;
+			for(j=i-used[i]+1;j<i;++j){
+				FLAC__static_encoder_delete(q->sq[j]->enc);//simple_enc only deletes previous if sample_cnt>0, and we're manually messing with that
+				q->sq[j]->enc=NULL;
+				q->sq[j]->sample_cnt=0;
+			}
+			saved_frames+=used[i]-1;
+		}
+		for(c=0;c<q->depth*span;++c){
+			if(cand[c]){//smaller but overlapped a better merge
+				decision_log(set, "merge", 0, cand[c]->curr_sample, cand[c]->sample_cnt, cand[c]->outbuf_size);
+				simple_enc_dealloc(cand[c]);
+			}
 		}
 
-		//shift empty simple_enc to end
-		if(saved_frames)
-			qsort(q->sq, q->depth, sizeof(simple_enc*), senc_comp_merge);
-		q->depth-=saved_frames;
+		//stable compaction of empty instances to the end
+		for(i=0, j=0;i<q->depth;++i){
+			if(q->sq[i]->sample_cnt){
+				swap=q->sq[j];
+				q->sq[j++]=q->sq[i];
+				q->sq[i]=swap;
+			}
+		}
+		q->depth=j;
+		since=q->gen;
 
+		trace_add(set->trace, "merge pass", pass, q->sq[0]->curr_sample, q->sq[q->depth-1]->curr_sample+q->sq[q->depth-1]->sample_cnt-q->sq[0]->curr_sample);
+		pass_saved(&(stat->saved_merge), &(stat->passes_merge), ind, saved_bytes);
 		++ind;
 		if(saved_bytes)
-			fprintf(stderr, "merge(%zu) saved %zu bytes with %zu merges\n", ind, saved_bytes, saved_frames);
-	}while(saved_bytes>=set->merge);
+			fprintf(stderr, "merge(%zu) saved %zu bytes removing %zu frames\n", ind, saved_bytes, saved_frames);
+		progress_report(set, stat, in, in->loc_analysis);
+	}while(saved_bytes>=(size_t)set->merge && q->depth>1);
+	free(cand);
+	free(gain);
+	free(total);
+	free(used);
 }
 
-static size_t qtweak(queue *q, flac_settings *set, input *in, stats *stat, int i, size_t newsplit, size_t *saved){
-	simple_enc *a, *b;
+/*Encode frames i and i+1 of the queue split newsplit samples in, as candidates a and b. Leaves them NULL if the split
+is out of range*/
+static void qtweak(queue *q, flac_settings *set, input *in, stats *stat, size_t i, size_t newsplit, simple_enc **a, simple_enc **b){
+	thread_stats *ts=stat->thread+omp_get_thread_num();
 	size_t bsize, tot=q->sq[i]->sample_cnt+q->sq[i+1]->sample_cnt;
 
+	*a=NULL;
+	*b=NULL;
 	if(newsplit<16 || newsplit>=(tot-16))
-		return 0;
+		return;
 	if(newsplit>set->blocksize_limit_upper || newsplit<set->blocksize_limit_lower)
-		return 0;
+		return;
 	bsize=tot-newsplit;
 	if(bsize>set->blocksize_limit_upper || bsize<set->blocksize_limit_lower)
-		return 0;
+		return;
 
-	a=calloc(1, sizeof(simple_enc));
-	b=calloc(1, sizeof(simple_enc));
-	stat->effort_tweak[omp_get_thread_num()]+=q->sq[i]->sample_cnt+q->sq[i+1]->sample_cnt;
-	simple_enc_analyse(a, set, in, newsplit, q->sq[i]->curr_sample, NULL);
-	simple_enc_analyse(b, set, in, bsize, q->sq[i]->curr_sample+newsplit, NULL);
-	if((a->outbuf_size+b->outbuf_size)<(q->sq[i]->outbuf_size+q->sq[i+1]->outbuf_size)){
-		(*saved)+=((q->sq[i]->outbuf_size+q->sq[i+1]->outbuf_size) - (a->outbuf_size+b->outbuf_size));
-		simple_enc_dealloc(q->sq[i]);
-		simple_enc_dealloc(q->sq[i+1]);
-		q->sq[i]=a;
-		q->sq[i+1]=b;
-		return 1;
-	}
-	else{
-		simple_enc_dealloc(a);
-		simple_enc_dealloc(b);
-		return 0;
+	*a=calloc(1, sizeof(simple_enc));
+	*b=calloc(1, sizeof(simple_enc));
+	ts->effort_tweak+=tot;
+	ts->encodes+=2;
+	simple_enc_analyse(*a, set, in, newsplit, q->sq[i]->curr_sample, NULL);
+	simple_enc_analyse(*b, set, in, bsize, q->sq[i]->curr_sample+newsplit, NULL);
+}
+
+/*Smallest split offset the tweak search refines to*/
+#define TWEAK_MIN 16
+
+/*Most candidates in a tweak round, either side of the split for every halving from 65535/2 to TWEAK_MIN*/
+#define TWEAK_CAND 24
+
+/*Search the split between frames i and i+1 coarse to fine. A round tries the split moved either way by off, off/2 and
+so on down to TWEAK_MIN, encoding every candidate as a task, and takes the smallest pair. Rounds repeat from the
+new split with off set to the winning offset until none helps. The first off is blocks[0]/2, or TWEAK_MIN for tiny
+blocksizes. The best pair is left in a/b with the bytes it saves returned, a/b are NULL and 0 returned if no move helps*/
+static size_t qtweak_search(queue *q, flac_settings *set, input *in, stats *stat, size_t i, simple_enc **a, simple_enc **b){
+	simple_enc *ca[TWEAK_CAND], *cb[TWEAK_CAND];
+	size_t best, c, cnt, off=set->blocks[0]/2, orig=q->sq[i]->outbuf_size+q->sq[i+1]->outbuf_size, pick, split=q->sq[i]->sample_cnt;
+	*a=NULL;
+	*b=NULL;
+	best=orig;
+	if(off<TWEAK_MIN)
+		off=TWEAK_MIN;
+	while(off>=TWEAK_MIN){
+		for(cnt=0;(off>>(cnt/2))>=TWEAK_MIN;cnt+=2);
+		#pragma omp taskloop grainsize(1) shared(ca, cb)
+		for(c=0;c<cnt;++c)
+			qtweak(q, set, in, stat, i, (c&1)?split+(off>>(c/2)):split-(off>>(c/2)), ca+c, cb+c);
+
+		//smallest candidate wins, ties to the largest move
+		pick=cnt;
+		for(c=0;c<cnt;++c){
+			if(ca[c] && ca[c]->outbuf_size+cb[c]->outbuf_size<best){
+				best=ca[c]->outbuf_size+cb[c]->outbuf_size;
+				pick=c;
+			}
+		}
+		for(c=0;c<cnt;++c){
+			if(ca[c] && c!=pick){
+				decision_log(set, "tweak", 0, ca[c]->curr_sample, ca[c]->sample_cnt, ca[c]->outbuf_size);
+				decision_log(set, "tweak", 0, cb[c]->curr_sample, cb[c]->sample_cnt, cb[c]->outbuf_size);
+				simple_enc_dealloc(ca[c]);
+				simple_enc_dealloc(cb[c]);
+			}
+		}
+		if(pick==cnt)
+			break;
+		if(*a){
+			simple_enc_dealloc(*a);
+			simple_enc_dealloc(*b);
+		}
+		*a=ca[pick];
+		*b=cb[pick];
+		split=(*a)->sample_cnt;
+		off>>=pick/2;
 	}
+	return orig-best;
 }
 
-/*Do tweak passes on queue*/
-static void queue_tweak(queue *q, flac_settings *set, input *in, stats *stat){
-	size_t i, ind=0, saved_bytes, saved_frames;
-	if(!set->tweak)
+/*Do tweak passes on queue. Every pair's split is searched to convergence as one dynamically scheduled task in a
+single parallel phase, then a linear DP picks the set of pairs not sharing a frame that saves the most, same as
+queue_merge. After the first pass only pairs with a frame changed by the previous pass are searched, the first
+pass skips pairs already searched in the last flush*/
+void queue_tweak(queue *q, flac_settings *set, input *in, stats *stat, size_t since){
+	simple_enc **ta, **tb;
+	double pass, tr;
+	size_t *gain, i, ind=0, saved_bytes, saved_frames, *total, *used;
+	if(!set->tweak || q->depth<2)
 		return;
+	//ta[i]/tb[i] are the best re-split of frames i and i+1
+	ta=malloc(sizeof(simple_enc*)*q->depth);
+	tb=malloc(sizeof(simple_enc*)*q->depth);
+	gain=malloc(sizeof(size_t)*q->depth);
+	total=malloc(sizeof(size_t)*(q->depth+1));
+	used=malloc(sizeof(size_t)*(q->depth+1));
 	do{
-		for(i=0;i<set->work_count;++i){
-			q->cnt[i]=0;
-			q->saved[i]=0;
-		}
-
-		#pragma omp parallel for num_threads(set->work_count)
-		for(i=0;i<q->depth/2;++i){//even pairs
-			size_t pivot=q->sq[2*i]->sample_cnt;
-			q->cnt[omp_get_thread_num()]+=qtweak(q, set, in, stat, 2*i, pivot-(set->blocks[0]/(ind+2)), &(q->saved[omp_get_thread_num()]));
-			q->cnt[omp_get_thread_num()]+=qtweak(q, set, in, stat, 2*i, pivot+(set->blocks[0]/(ind+2)), &(q->saved[omp_get_thread_num()]));
+		++q->gen;
+		pass=trace_now(set->trace);
+		tr=pass;
+		#pragma omp parallel for num_threads(set->work_count) schedule(dynamic)
+		for(i=0;i<q->depth-1;++i){
+			ta[i]=NULL;
+			gain[i]=qdirty(q, i, 2, since)?qtweak_search(q, set, in, stat, i, ta+i, tb+i):0;
 		}
 		#pragma omp barrier
-
-		#pragma omp parallel for num_threads(set->work_count)
-		for(i=0;i<(q->depth-1)/2;++i){//odd pairs
-			size_t pivot=q->sq[(2*i)+1]->sample_cnt;
-			q->cnt[omp_get_thread_num()]+=qtweak(q, set, in, stat, (2*i)+1, pivot-(set->blocks[0]/(ind+2)), &(q->saved[omp_get_thread_num()]));
-			q->cnt[omp_get_thread_num()]+=qtweak(q, set, in, stat, (2*i)+1, pivot+(set->blocks[0]/(ind+2)), &(q->saved[omp_get_thread_num()]));
+		trace_barrier(set->trace, tr);
+
+		//total[n] is the best saving using tweaks entirely within the first n frames, used[n] is 2 if the last is one
+		total[0]=0;
+		for(i=1;i<=q->depth;++i){
+			total[i]=total[i-1];
+			used[i]=1;
+			if(i>=2 && ta[i-2] && total[i-2]+gain[i-2]>total[i]){
+				total[i]=total[i-2]+gain[i-2];
+				used[i]=2;
+			}
 		}
-		#pragma omp barrier
 
-		//gather stats
-		for(i=0, saved_bytes=0, saved_frames=0;i<set->work_count;++i){
-			saved_bytes+=q->saved[i];
-			saved_frames+=q->cnt[i];
+		saved_bytes=total[q->depth];
+		saved_frames=0;
+		for(i=q->depth;i;i-=used[i]){
+			if(used[i]==1)
+				continue;
+			decision_log(set, "tweak", 1, ta[i-2]->curr_sample, ta[i-2]->sample_cnt, ta[i-2]->outbuf_size);
+			decision_log(set, "tweak", 1, tb[i-2]->curr_sample, tb[i-2]->sample_cnt, tb[i-2]->outbuf_size);
+			simple_enc_dealloc(q->sq[i-2]);
+			simple_enc_dealloc(q->sq[i-1]);
+			q->sq[i-2]=ta[i-2];
+			q->sq[i-1]=tb[i-2];
+			q->sq[i-2]->gen=q->gen;
+			q->sq[i-1]->gen=q->gen;
+			ta[i-2]=NULL;
+			++saved_frames;
 		}
+		for(i=0;i<q->depth-1;++i){
+			if(ta[i]){//smaller but shared a frame with a better tweak
+				decision_log(set, "tweak", 0, ta[i]->curr_sample, ta[i]->sample_cnt, ta[i]->outbuf_size);
+				decision_log(set, "tweak", 0, tb[i]->curr_sample, tb[i]->sample_cnt, tb[i]->outbuf_size);
+				simple_enc_dealloc(ta[i]);
+				simple_enc_dealloc(tb[i]);
+			}
+		}
+		since=q->gen;
 
+		trace_add(set->trace, "tweak pass", pass, q->sq[0]->curr_sample, q->sq[q->depth-1]->curr_sample+q->sq[q->depth-1]->sample_cnt-q->sq[0]->curr_sample);
+		pass_saved(&(stat->saved_tweak), &(stat->passes_tweak), ind, saved_bytes);
 		++ind;
 		if(saved_bytes)
-			fprintf(stderr, "tweak(%zu) saved %zu bytes with %zu tweaks\n", ind, saved_bytes, saved_frames);
+			fprintf(stderr, "tweak(%zu) saved %zu bytes moving %zu splits\n", ind, saved_bytes, saved_frames);
+		progress_report(set, stat, in, in->loc_analysis);
 	}while(saved_bytes>=set->tweak);
+	free(ta);
+	free(tb);
+	free(gain);
+	free(total);
+	free(used);
+}
+
+/*Candidate frames in the resegment DP span at most this many points, with points at every boundary and midpoint that
+covers half frames, frames shifted by half, one and a half frames and merged pairs*/
+#define RESEG_SPAN 4
+
+/*Re-segment the queue in one pass. Split points are the existing frame boundaries plus frame midpoints, every
+candidate frame between them is encoded in parallel and a DP picks the cheapest segmentation. Existing frames are
+candidates with known size so the result is never worse. Needs room for up to 2*depth frames in the queue*/
+static void queue_resegment(queue *q, flac_settings *set, input *in, stats *stat){
+	simple_enc **pool, **sq;
+	uint8_t *fresh;
+	double reseg, tr;
+	size_t a, d, *best, *choice, i, *edge, edge_cnt=0, *edges, j, k, len, pool_cnt=0, pt_cnt=(2*q->depth)+1, saved, *size;
+	uint64_t *pt;
+	if(!set->resegment || q->depth<2)
+		return;
+	reseg=trace_now(set->trace);
+	pt=malloc(sizeof(uint64_t)*pt_cnt);
+	for(i=0;i<q->depth;++i){
+		pt[2*i]=q->sq[i]->curr_sample;
+		pt[(2*i)+1]=q->sq[i]->curr_sample+(q->sq[i]->sample_cnt/2);
+	}
+	pt[2*q->depth]=q->sq[q->depth-1]->curr_sample+q->sq[q->depth-1]->sample_cnt;
+
+	//size[(a*RESEG_SPAN)+d-1] is the frame from point a to point a+d, SIZE_MAX if not a valid frame
+	size=malloc(sizeof(size_t)*pt_cnt*RESEG_SPAN);
+	edges=malloc(sizeof(size_t)*pt_cnt*RESEG_SPAN);
+	for(a=0;a<pt_cnt;++a){
+		for(d=1;d<=RESEG_SPAN;++d){
+			size[(a*RESEG_SPAN)+d-1]=SIZE_MAX;
+			if(a+d>=pt_cnt)
+				continue;
+			if(!(a%2) && d==2){//existing frame
+				size[(a*RESEG_SPAN)+d-1]=q->sq[a/2]->outbuf_size;
+				continue;
+			}
+			len=pt[a+d]-pt[a];
+			if(len<16 || len<(size_t)set->blocksize_limit_lower || len>(size_t)set->blocksize_limit_upper)
+				continue;
+			edges[edge_cnt++]=(a*RESEG_SPAN)+d-1;
+		}
+	}
+
+	tr=trace_now(set->trace);
+	#pragma omp parallel num_threads(set->work_count)
+	{
+		simple_enc *tw=calloc(1, sizeof(simple_enc));
+		#pragma omp for schedule(dynamic)
+		for(i=0;i<edge_cnt;++i){
+			stat->thread[omp_get_thread_num()].effort_reseg+=pt[(edges[i]/RESEG_SPAN)+(edges[i]%RESEG_SPAN)+1]-pt[edges[i]/RESEG_SPAN];
+			++stat->thread[omp_get_thread_num()].encodes;
+			simple_enc_analyse(tw, set, in, pt[(edges[i]/RESEG_SPAN)+(edges[i]%RESEG_SPAN)+1]-pt[edges[i]/RESEG_SPAN], pt[edges[i]/RESEG_SPAN], NULL);
+			size[edges[i]]=tw->outbuf_size;
+		}
+		simple_enc_dealloc(tw);
+	}
+	#pragma omp barrier
+	trace_barrier(set->trace, tr);
+
+	best=malloc(sizeof(size_t)*pt_cnt);
+	choice=malloc(sizeof(size_t)*pt_cnt);
+	best[0]=0;
+	for(k=1;k<pt_cnt;++k){
+		best[k]=SIZE_MAX;
+		for(d=1;d<=RESEG_SPAN && d<=k;++d){
+			if(best[k-d]==SIZE_MAX || size[((k-d)*RESEG_SPAN)+d-1]==SIZE_MAX)
+				continue;
+			if(best[k-d]+size[((k-d)*RESEG_SPAN)+d-1]<best[k]){
+				best[k]=best[k-d]+size[((k-d)*RESEG_SPAN)+d-1];
+				choice[k]=d;
+			}
+		}
+	}
+	assert(best[pt_cnt-1]!=SIZE_MAX);
+	for(i=0, saved=0;i<q->depth;++i)
+		saved+=q->sq[i]->outbuf_size;
+	saved-=best[pt_cnt-1];
+
+	//traceback into edge, front to back
+	edge=malloc(sizeof(size_t)*pt_cnt);
+	for(k=pt_cnt-1, j=0;k;k-=choice[k])
+		edge[j++]=((k-choice[k])*RESEG_SPAN)+choice[k]-1;
+	for(i=0;i<j/2;++i){
+		a=edge[i];
+		edge[i]=edge[j-1-i];
+		edge[j-1-i]=a;
+	}
+
+	//rebuild the queue, kept frames stay as they are and new frames are encoded again into spare instances. Keeping
+	//every candidate encode instead would hold an encoder per edge, a few per frame of a queue that can be thousands deep
+	sq=malloc(sizeof(simple_enc*)*2*set->queue_size);
+	pool=malloc(sizeof(simple_enc*)*2*set->queue_size);
+	fresh=malloc(j);
+	for(i=0;i<2*(size_t)set->queue_size;++i)
+		sq[i]=NULL;
+	for(i=0;i<j;++i){
+		if(!((edge[i]/RESEG_SPAN)%2) && edge[i]%RESEG_SPAN==1){
+			sq[i]=q->sq[(edge[i]/RESEG_SPAN)/2];
+			q->sq[(edge[i]/RESEG_SPAN)/2]=NULL;
+		}
+	}
+	for(i=0;i<2*(size_t)set->queue_size;++i){
+		if(q->sq[i])
+			pool[pool_cnt++]=q->sq[i];
+	}
+	for(i=0, k=0;i<j;++i){
+		fresh[i]=!sq[i];
+		if(fresh[i]){
+			sq[i]=pool[k++];
+			sq[i]->gen=q->gen+1;//counts as new to merge/tweak
+		}
+	}
+	tr=trace_now(set->trace);
+	#pragma omp parallel for num_threads(set->work_count) schedule(dynamic)
+	for(i=0;i<j;++i){
+		if(fresh[i]){
+			stat->thread[omp_get_thread_num()].effort_reseg+=pt[(edge[i]/RESEG_SPAN)+(edge[i]%RESEG_SPAN)+1]-pt[edge[i]/RESEG_SPAN];
+			++stat->thread[omp_get_thread_num()].encodes;
+			simple_enc_analyse(sq[i], set, in, pt[(edge[i]/RESEG_SPAN)+(edge[i]%RESEG_SPAN)+1]-pt[edge[i]/RESEG_SPAN], pt[edge[i]/RESEG_SPAN], NULL);
+		}
+	}
+	#pragma omp barrier
+	trace_barrier(set->trace, tr);
+	for(i=j;k<pool_cnt;++i)
+		sq[i]=pool[k++];
+	memcpy(q->sq, sq, sizeof(simple_enc*)*2*set->queue_size);
+	if(saved)
+		fprintf(stderr, "resegment saved %zu bytes, %zu frames became %zu\n", saved, q->depth, j);
+	q->depth=j;
+	trace_add(set->trace, "resegment", reseg, pt[0], pt[pt_cnt-1]-pt[0]);
+
+	free(pt);
+	free(size);
+	free(edges);
+	free(best);
+	free(choice);
+	free(edge);
+	free(sq);
+	free(pool);
+	free(fresh);
+}
+
+/*Whether the nth frame of the output uses the normal output settings instead of outputalt. Spreads outperc% of
+frames evenly by frame index so the choice doesn't depend on which worker encodes a frame*/
+static int outperc_normal(flac_settings *set, uint64_t n){
+	return ((n+1)*set->outperc)/100>(n*set->outperc)/100;
 }
 
 #define INLOC_OUT  ((in->set->bps==16?2:4)*in->set->channels*(in->loc_output-in->loc_buffer))
 #define INLOC_LAST ((in->set->bps==16?2:4)*in->set->channels*(in->sample_cnt+(in->loc_analysis-in->loc_buffer)))
-/*Flush queue to file*/
-static void simple_enc_flush(queue *q, flac_settings *set, input *in, stats *stat, output *out){
-	size_t i;
+/*Flush queue to file, all but the last keep frames which stay queued as context for merge/tweak in the next flush.
+Frames added since the last flush have a gen of at least since*/
+static void simple_enc_flush(queue *q, flac_settings *set, input *in, stats *stat, output *out, size_t keep){
+	size_t i, since=q->gen+1, write;
+	simple_enc *swap;
+	double flush, tr;
+	uint64_t start;
 	if(!q->depth)
 		return;
+	flush=trace_now(set->trace);
+	start=q->sq[0]->curr_sample;
+	phase_end(stat, PHASE_ANAL);
+	if(set->resegment)
+		queue_resegment(q, set, in, stat);
+	phase_end(stat, PHASE_RESEG);
 	if(set->merge)
-		queue_merge(q, set, in, stat);
+		queue_merge(q, set, in, stat, since);
+	phase_end(stat, PHASE_MERGE);
 	if(set->tweak)
-		queue_tweak(q, set, in, stat);
+		queue_tweak(q, set, in, stat, since);
+	phase_end(stat, PHASE_TWEAK);
+	write=q->depth>keep?q->depth-keep:0;
 	if(set->diff_comp_settings){//encode with output settings if necessary
+		tr=trace_now(set->trace);
 		#pragma omp parallel for num_threads(set->work_count)
-		for(i=0;i<q->depth;++i){
-			q->outstate[omp_get_thread_num()]+=set->outperc;
-			simple_enc_encode(q->sq[i], set, in, q->sq[i]->sample_cnt, q->sq[i]->curr_sample, (q->outstate[omp_get_thread_num()]>=100)?0:2, stat);
-			q->outstate[omp_get_thread_num()]%=100;
+		for(i=0;i<write;++i){
+			simple_enc_encode(q->sq[i], set, in, q->sq[i]->sample_cnt, q->sq[i]->curr_sample, outperc_normal(set, q->frames_out+i)?0:2, stat);
 		}
 		#pragma omp barrier
+		trace_barrier(set->trace, tr);
 	}
 	//discard samples that are fully processed, ie have been output encoded
 	memmove(in->buf, ((uint8_t*)in->buf)+INLOC_OUT, INLOC_LAST-INLOC_OUT);
 	in->loc_buffer=in->loc_output;
+	phase_end(stat, PHASE_OUTPUT);
+	tr=trace_now(set->trace);
 
-	for(i=0;i<q->depth;++i){//dump to file
+	for(i=0;i<write;++i){//dump to file
 		if(set->seektable)
 			seektable_add(&(out->seektable), out->sampleloc, out->outloc-out->seektable.firstframe_loc, q->sq[i]->sample_cnt);
 		out->sampleloc+=q->sq[i]->sample_cnt;
@@ -341,66 +774,245 @@ static void simple_enc_flush(queue *q, flac_settings *set, input *in, stats *sta
 			set->blocksize_min=q->sq[i]->sample_cnt<16?set->blocksize_min:q->sq[i]->sample_cnt;//values 0-15 are invalid per spec. This only happens for a very small last frame on variable encodes
 		if(q->sq[i]->sample_cnt>set->blocksize_max)
 			set->blocksize_max=q->sq[i]->sample_cnt;
+		if(stat->blocksize_hist)
+			++stat->blocksize_hist[q->sq[i]->sample_cnt];
+		decision_log(set, "output", 1, q->sq[i]->curr_sample, q->sq[i]->sample_cnt, q->sq[i]->outbuf_size);
 		out_write(out, q->sq[i]->outbuf, q->sq[i]->outbuf_size);
 	}
-	q->depth=0;//reset
+	for(i=write;i<q->depth;++i){//slide context to the front
+		swap=q->sq[i-write];
+		q->sq[i-write]=q->sq[i];
+		q->sq[i]=swap;
+	}
+	trace_add(set->trace, "write", tr, start, in->loc_output-start);
+	q->frames_out+=write;
+	q->depth-=write;
+	phase_end(stat, PHASE_WRITE);
+	trace_add(set->trace, "flush", flush, start, in->loc_output-start);
+}
+
+void progress_report(flac_settings *set, stats *stat, input *in, uint64_t analysed){
+	FILE *f;
+	double elapsed, now, rate, ratio;
+	uint64_t eta;
+	if(!set->progress)
+		return;
+	if(analysed>stat->progress_analysed)
+		stat->progress_analysed=analysed;
+	analysed=stat->progress_analysed;
+	now=omp_get_wtime();
+	if(now-stat->progress_last<set->progress)
+		return;
+	stat->progress_last=now;
+	elapsed=now-stat->wall_time;//wall_time holds the start until the mode finishes
+	rate=elapsed>0?analysed/elapsed:0;
+	ratio=(in->out && in->loc_output)?((double)in->out->outloc)/(in->loc_output*set->channels*((set->bps+7)/8)):0;
+	f=set->progress_file?fopen(set->progress_file, "w"):stderr;
+	if(!f)
+		return;
+	fprintf(f, "progress\t%"PRIu64, analysed);
+	if(set->input_tot_samples)
+		fprintf(f, "/%"PRIu64" (%.1f%%)", set->input_tot_samples, (100.0*analysed)/set->input_tot_samples);
+	fprintf(f, " samples\t%.1fx realtime\tratio %.4f", rate/set->sample_rate, ratio);
+	if(set->input_tot_samples && rate>0 && set->input_tot_samples>analysed){
+		eta=(set->input_tot_samples-analysed)/rate;
+		fprintf(f, "\teta %"PRIu64":%02u:%02u", eta/3600, (unsigned)((eta/60)%60), (unsigned)(eta%60));
+	}
+	fprintf(f, "\n");
+	if(set->progress_file)
+		fclose(f);
 }
 
 /*Add analysed+chosen frame to output queue. Swap out simple_enc instance to an unused one, queue takes control of senc*/
 simple_enc* simple_enc_out(queue *q, simple_enc *senc, flac_settings *set, input *in, stats *stat, output *out){
 	simple_enc *ret;
 	if(q->depth==set->queue_size)
-		simple_enc_flush(q, set, in, stat, out);
+		simple_enc_flush(q, set, in, stat, out, set->queue_overlap);
+	senc->gen=q->gen+1;
 	in->loc_analysis+=senc->sample_cnt;
 	in->sample_cnt-=senc->sample_cnt;
+	progress_report(set, stat, in, in->loc_analysis);
 	ret=q->sq[q->depth];
 	q->sq[q->depth++]=senc;
 	return ret;
 }
 
+/*Chain index of an encode by where it starts and its length*/
+static size_t spec_hash(spec_cache *c, uint64_t curr_sample, uint32_t samples){
+	uint64_t h=(curr_sample*0x9E3779B97F4A7C15ULL)^(samples*0xC2B2AE3D27D4EB4FULL);
+	return (h^(h>>32))&(c->chain_cnt-1);
+}
+
+/*Slot holding the encode at curr_sample/samples, c->cnt if there isn't one*/
+static size_t spec_find(spec_cache *c, uint64_t curr_sample, uint32_t samples){
+	size_t i;
+	if(!c->chain_cnt)
+		return c->cnt;
+	for(i=c->chain[spec_hash(c, curr_sample, samples)];i;i=c->link[i-1]){
+		if(c->senc[i-1]->curr_sample==curr_sample && c->senc[i-1]->sample_cnt==samples)
+			return i-1;
+	}
+	return c->cnt;
+}
+
+static void spec_link(spec_cache *c, size_t slot){
+	size_t h=spec_hash(c, c->senc[slot]->curr_sample, c->senc[slot]->sample_cnt);
+	c->link[slot]=c->chain[h];
+	c->chain[h]=slot+1;
+}
+
+/*Unindex a slot and put it on the free list*/
+static void spec_free(spec_cache *c, size_t slot){
+	size_t *i=c->chain+spec_hash(c, c->senc[slot]->curr_sample, c->senc[slot]->sample_cnt);
+	while(*i!=slot+1)
+		i=c->link+(*i-1);
+	*i=c->link[slot];
+	c->state[slot]=SPEC_FREE;
+	c->free_slot[c->free_cnt++]=slot;
+}
+
+int spec_request(spec_cache *c, uint64_t curr_sample, uint32_t samples){
+	size_t i, slot;
+	if(spec_find(c, curr_sample, samples)!=c->cnt)
+		return 0;
+	if(!c->free_cnt){
+		if(c->cnt==c->alloc){//grow and rebuild the index with as many chains as slots
+			c->alloc=c->alloc?c->alloc*2:16;
+			c->senc=realloc(c->senc, sizeof(simple_enc*)*c->alloc);
+			c->state=realloc(c->state, sizeof(int)*c->alloc);
+			c->link=realloc(c->link, sizeof(size_t)*c->alloc);
+			c->free_slot=realloc(c->free_slot, sizeof(size_t)*c->alloc);
+			free(c->chain);
+			c->chain_cnt=c->alloc;
+			c->chain=calloc(c->chain_cnt, sizeof(size_t));
+			for(i=0;i<c->cnt;++i){
+				if(c->state[i]!=SPEC_FREE)
+					spec_link(c, i);
+			}
+		}
+		c->senc[c->cnt]=calloc(1, sizeof(simple_enc));
+		c->free_slot[c->free_cnt++]=c->cnt++;
+	}
+	slot=c->free_slot[--c->free_cnt];
+	c->state[slot]=SPEC_PENDING;
+	c->senc[slot]->curr_sample=curr_sample;
+	c->senc[slot]->sample_cnt=samples;
+	spec_link(c, slot);
+	return 1;
+}
+
+void spec_run(spec_cache *c, flac_settings *set, input *in, stats *stat){
+	double tr;
+	size_t i, *pending, pending_cnt=0;
+	pending=malloc(sizeof(size_t)*(c->cnt+1));
+	for(i=0;i<c->cnt;++i){
+		if(c->state[i]==SPEC_PENDING)
+			pending[pending_cnt++]=i;
+	}
+	tr=trace_now(set->trace);
+	#pragma omp parallel for num_threads(set->work_count) schedule(dynamic)
+	for(i=0;i<pending_cnt;++i){
+		simple_enc_analyse(c->senc[pending[i]], set, in, c->senc[pending[i]]->sample_cnt, c->senc[pending[i]]->curr_sample, stat);
+		c->state[pending[i]]=SPEC_DONE;
+	}
+	#pragma omp barrier
+	trace_barrier(set->trace, tr);
+	free(pending);
+}
+
+int spec_take(spec_cache *c, simple_enc **senc, uint64_t curr_sample, uint32_t samples){
+	size_t i=spec_find(c, curr_sample, samples);
+	simple_enc *swap;
+	if(i==c->cnt || c->state[i]!=SPEC_DONE)
+		return 0;
+	spec_free(c, i);
+	swap=*senc;
+	*senc=c->senc[i];
+	c->senc[i]=swap;
+	return 1;
+}
+
+simple_enc *spec_peek(spec_cache *c, uint64_t curr_sample, uint32_t samples){
+	size_t i=spec_find(c, curr_sample, samples);
+	return (i==c->cnt || c->state[i]!=SPEC_DONE)?NULL:c->senc[i];
+}
+
+void spec_discard(spec_cache *c, uint64_t before){
+	size_t i;
+	for(i=0;i<c->cnt;++i){
+		if(c->state[i]!=SPEC_FREE && c->senc[i]->curr_sample<before)
+			spec_free(c, i);
+	}
+}
+
+void spec_keep(spec_cache *c, const uint64_t *start, size_t start_cnt){
+	size_t i, j;
+	for(i=0;i<c->cnt;++i){
+		if(c->state[i]==SPEC_FREE)
+			continue;
+		for(j=0;j<start_cnt && start[j]!=c->senc[i]->curr_sample;++j);
+		if(j==start_cnt)
+			spec_free(c, i);
+	}
+}
+
+void spec_dealloc(spec_cache *c){
+	size_t i;
+	for(i=0;i<c->cnt;++i)
+		simple_enc_dealloc(c->senc[i]);
+	free(c->senc);
+	free(c->state);
+	free(c->chain);
+	free(c->link);
+	free(c->free_slot);
+	memset(c, 0, sizeof(spec_cache));
+}
+
 void queue_alloc(queue *q, flac_settings *set){
 	size_t i;
 	assert(set->queue_size>0);
 	q->depth=0;
-	q->sq=calloc(set->queue_size, sizeof(simple_enc*));
-	for(i=0;i<set->queue_size;++i)
+	q->gen=0;
+	q->frames_out=0;
+	q->sq=calloc(set->queue_size*(set->resegment?2:1), sizeof(simple_enc*));//resegment can split every frame in two
+	for(i=0;i<(size_t)set->queue_size*(set->resegment?2:1);++i)
 		q->sq[i]=calloc(1, sizeof(simple_enc));
-	q->outstate=calloc(set->work_count, sizeof(int));
-	q->saved=calloc(set->work_count, sizeof(size_t));
-	q->cnt=calloc(set->work_count, sizeof(size_t));
 }
 
 void queue_dealloc(queue *q, flac_settings *set, input *in, stats *stat, output *out){
 	size_t i;
-	simple_enc_flush(q, set, in, stat, out);
-	for(i=0;i<set->queue_size;++i)
+	simple_enc_flush(q, set, in, stat, out, 0);
+	for(i=0;i<(size_t)set->queue_size*(set->resegment?2:1);++i)
 		simple_enc_dealloc(q->sq[i]);
 	free(q->sq);
 	q->sq=NULL;
-	free(q->outstate);
-	q->outstate=NULL;
-	free(q->saved);
-	q->saved=NULL;
-	free(q->cnt);
-	q->cnt=NULL;
 }
 
-void mode_boilerplate_init(flac_settings *set, clock_t *cstart, queue *q, stats *stat){
+void mode_boilerplate_init(flac_settings *set, clock_t *cstart, queue *q, stats *stat, input *in){
 	*cstart=clock();
+	in->stat=stat;
 	stat->work_count=set->work_count;
-	stat->effort_anal=calloc(set->work_count, sizeof(uint64_t));
-	stat->effort_output=calloc(set->work_count, sizeof(uint64_t));
-	stat->effort_tweak=calloc(set->work_count, sizeof(uint64_t));
-	stat->effort_merge=calloc(set->work_count, sizeof(uint64_t));
+	stat->thread=aligned_alloc(_Alignof(thread_stats), sizeof(thread_stats)*set->work_count);
+	memset(stat->thread, 0, sizeof(thread_stats)*set->work_count);
+	phase_begin(stat);
+	stat->wall_time=stat->mark_wall;//start, becomes the total in mode_boilerplate_finish
+	stat->progress_last=stat->mark_wall;
+	if(set->stats_json)
+		stat->blocksize_hist=calloc(65536, sizeof(uint64_t));
 	queue_alloc(q, set);
 }
 
 void mode_boilerplate_finish(flac_settings *set, clock_t *cstart, queue *q, stats *stat, input *in, output *out){
 	queue_dealloc(q, set, in, stat, out);
+	phase_end(stat, PHASE_ANAL);
 	in->input_close(in);
+	in->stat=NULL;//input_close and the checks aren't timed
 	_if((set->input_tot_samples && (set->input_tot_samples!=in->loc_analysis)), "Samples read different from what's in the input header (check input)");
 	_if((set->md5 && memcmp(set->input_md5, set->zero, 16)!=0 && memcmp(set->input_md5, set->hash, 16)!=0), "MD5 of output doesn't match what's in the input header (check input)");
 	stat->cpu_time=((double)(clock()-*cstart))/CLOCKS_PER_SEC;
+	stat->wall_time=stat->mark_wall-stat->wall_time;
 	print_settings(set);
 	print_stats(stat, in, out->outloc);
+	if(set->stats_json)
+		report_json(set->stats_json, set, stat, in, out->outloc);
 }
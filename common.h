@@ -5,9 +5,11 @@
 #include "FLAC/stream_encoder.h"
 
 #include "dr_wav.h"
+#include "trace.h"
 
 #include <inttypes.h>
 #include <omp.h>
+#include <pthread.h>
 #include <time.h>
 
 #ifdef USE_OPENSSL
@@ -18,14 +20,28 @@ typedef mbedtls_md5_context MD5_CTX;
 #endif
 
 enum{LAST_UNDEFINED, LAST_HEADER, LAST_SEEKTABLE, LAST_PRESERVED};
-enum{MODE_CHUNK, MODE_GSET, MODE_PEAKSET, MODE_GASC, MODE_FIXED};
+enum{MODE_CHUNK, MODE_GSET, MODE_PEAKSET, MODE_GASC, MODE_FIXED, MODE_TRANSIENT, MODE_BEAM};
 enum{UI_UNDEFINED, UI_PRESET, UI_MANUAL};
+enum{PHASE_READ, PHASE_MD5, PHASE_ANAL, PHASE_RESEG, PHASE_MERGE, PHASE_TWEAK, PHASE_OUTPUT, PHASE_WRITE, PHASE_COUNT};
 
 typedef struct{
-	int *blocks, diff_comp_settings, tweak, merge, mode, wildcard, outperc, queue_size, md5, lpc_order_limit, rice_order_limit, work_count, peakset_window, seek;
+	int *blocks, diff_comp_settings, tweak, merge, mode, wildcard, outperc, queue_size, md5, lpc_order_limit, rice_order_limit, work_count, peakset_window, seek, segments;
 	size_t blocks_count;
 	char *input_format;
 	char *comp_anal, *comp_output, *comp_outputalt, *apod_anal, *apod_output, *apod_outputalt;
+	int screen;//if non-zero, number of candidates per decision to fully analyse after estimating all
+	int transient_db, transient_verify;//transient mode detection threshold and whether to test splits with encodes
+	char *comp_coarse;//if set, peakset fills its grid with these cheap settings first ("est" for the size estimator)
+	int coarse_tol;//peakset keeps cells on coarse paths costing at most this many bytes more than the best
+	int beam;//number of partial segmentations beam mode keeps
+	int resegment;//if set, re-segment the output queue with a DP before merge/tweak
+	int merge_span;//most adjacent frames a single merge can combine
+	int queue_overlap;//frames kept queued after a flush so merge/tweak can work across flush boundaries
+	char *stats_json;//if set, path to write a JSON report to
+	trace *trace;//if set, worker activity is recorded for --trace
+	double progress;//seconds between progress reports, 0 for none
+	char *progress_file;//if set progress overwrites this file instead of going to stderr
+	FILE *decision_log;//if set, every candidate frame decided on is logged here as CSV
 	int lax, channels, bps, sample_rate;/*flac*/
 	uint32_t minf, maxf;
 	uint8_t hash[16], input_md5[16], zero[16];
@@ -35,10 +51,29 @@ typedef struct{
 	int ui_type, seektable, preserve_flac_metadata;
 } flac_settings;
 
+/*Counters a worker thread updates in hot loops. Each thread gets its own cache line aligned block so workers never
+write to the same line. Every member is a uint64_t so new metrics can be added here and are totalled by stats_total*/
 typedef struct{
-	uint64_t *effort_anal, *effort_output, *effort_tweak, *effort_merge;
+	_Alignas(64) uint64_t effort_anal;//samples encoded by kind
+	uint64_t effort_output, effort_tweak, effort_merge, effort_reseg;
+	uint64_t encodes;
+	uint64_t phase_cpu[PHASE_COUNT];//nanoseconds of this thread's cpu time spent in each phase
+} thread_stats;
+
+typedef struct{
+	thread_stats *thread;//work_count blocks
 	double cpu_time;
 	size_t work_count;
+	double phase_wall[PHASE_COUNT];//seconds, cpu per phase is kept per thread in thread_stats
+	double mark_wall;//when the phase being timed started
+	clockid_t *thread_clock;//cpu clock of each worker, registered by phase_begin
+	uint64_t *thread_mark;//nanoseconds on each worker's clock when it was last sampled
+	double wall_time;
+	double progress_last;//when progress was last reported
+	uint64_t progress_analysed;//furthest analysis has been reported to get, so progress never goes backwards
+	uint64_t *blocksize_hist;//frames written per blocksize, 65536 entries, only allocated for --stats-json
+	uint64_t *saved_merge, *saved_tweak;//bytes saved by the nth merge/tweak pass of a flush, summed over flushes
+	size_t passes_merge, passes_tweak;
 } stats;
 
 /*wrap a static encoder with its output*/
@@ -47,16 +82,30 @@ typedef struct{
 	uint8_t *outbuf;
 	size_t outbuf_size, sample_cnt;
 	uint64_t curr_sample;
+	size_t gen;//queue pass that last changed this frame, lets merge/tweak skip what they've already tried
 } simple_enc;
 
 /*output queue*/
 typedef struct{
 	simple_enc **sq;
 	size_t depth;
-	int *outstate;
-	size_t *saved, *cnt;
+	size_t gen;//merge/tweak pass counter
+	uint64_t frames_out;//frames written so far, the index of the next frame for --outperc
 } queue;
 
+/*Analysis encodes done ahead of time. A mode requests encodes it might need, runs them as one parallel batch,
+then takes the ones it actually uses. Slots are recycled rather than freed, and indexed by start and length*/
+typedef struct{
+	simple_enc **senc;
+	int *state;//SPEC_FREE/SPEC_PENDING/SPEC_DONE
+	size_t cnt, alloc;
+	size_t *chain, chain_cnt;//hash chains of used slots, slot+1 with 0 ending a chain
+	size_t *link;//next slot+1 in a slot's chain
+	size_t *free_slot, free_cnt;
+} spec_cache;
+
+enum{SPEC_FREE, SPEC_PENDING, SPEC_DONE};
+
 typedef struct{
 	uint64_t sample_num, offset;
 	uint16_t frame_sample_cnt;
@@ -99,6 +148,7 @@ typedef struct input{
 
 	flac_settings *set;//flac/wav fills vitals in
 	output *out;//when preserving flac input metadata it's done in the metadata callback
+	stats *stat;//read/MD5 timing, NULL until a mode starts
 
 	MD5_CTX ctx;//hash as input read
 
@@ -111,8 +161,36 @@ void _(char *s);
 void _if(int goodbye, char *s);
 FLAC__StaticEncoder *init_static_encoder(flac_settings *set, int blocksize, char *comp, char *apod);
 void print_settings(flac_settings *set);
+char *mode_name(int mode);
+char *phase_name(int phase);
+
+/*Log a candidate frame to --decision-log if set. source is the mode or pass that made the decision, chosen is 1 if
+the frame was taken. Safe to call from parallel regions*/
+void decision_log(flac_settings *set, const char *source, int chosen, uint64_t curr_sample, size_t samples, size_t bytes);
+
+/*greatest common divisor of the blocksize list*/
+size_t blocksize_gcd(flac_settings *set);
 void print_stats(stats *stat, input *in, size_t outsize);
 
+/*Sum every thread's counters into tot. Only call outside parallel regions*/
+void stats_total(stats *stat, thread_stats *tot);
+
+/*Start timing a phase. Phases are timed from the single-threaded sections only, stat can be NULL*/
+void phase_begin(stats *stat);
+
+/*Add the time since phase_begin or the last phase_end to a phase and start timing the next*/
+void phase_end(stats *stat, int phase);
+
+/*Merge/tweak passes over the queue, only frames with gen>=since are considered changed. Normally only called when
+flushing, public for microbench*/
+void queue_merge(queue *q, flac_settings *set, input *in, stats *stat, size_t since);
+void queue_tweak(queue *q, flac_settings *set, input *in, stats *stat, size_t since);
+
+/*Report progress if --progress seconds have passed since the last report. analysed is how far analysis has got, which
+modes that analyse a window before queueing frames can put ahead of loc_analysis. Ratio is of what's been written so far.
+Only call outside parallel regions*/
+void progress_report(flac_settings *set, stats *stat, input *in, uint64_t analysed);
+
 /*allocate the queue*/
 void queue_alloc(queue *q, flac_settings *set);
 
@@ -123,6 +201,9 @@ void queue_dealloc(queue *q, flac_settings *set, input *in, stats *stat, output
 Also MD5 input if context present, it is up to the analysis algorithm if and when to hash*/
 void simple_enc_analyse(simple_enc *senc, flac_settings *set, input *in, uint32_t samples, uint64_t curr_sample, stats *stat);
 
+/*encode an analysis frame with the cheap comp_coarse settings*/
+void simple_enc_coarse(simple_enc *senc, flac_settings *set, input *in, uint32_t samples, uint64_t curr_sample, stats *stat);
+
 void simple_enc_dealloc(simple_enc *senc);
 
 /*Encode and output the rest of the file as a single frame with output settings if there's not enough of the file left for analysis to chew on
@@ -136,7 +217,27 @@ Return a fresh context as the queue has taken the old one
 Advance curr_sample value*/
 simple_enc *simple_enc_out(queue *q, simple_enc *senc, flac_settings *set, input *in, stats *stat, output *out);
 
-void mode_boilerplate_init(flac_settings *set, clock_t *cstart, queue *q, stats *stat);
+/*Request an analysis encode be done on the next spec_run, returns 1 if a new request was made*/
+int spec_request(spec_cache *c, uint64_t curr_sample, uint32_t samples);
+
+/*Do all pending encodes in parallel*/
+void spec_run(spec_cache *c, flac_settings *set, input *in, stats *stat);
+
+/*If an encode matching curr_sample/samples is done, swap it into *senc and return 1. The old *senc is recycled*/
+int spec_take(spec_cache *c, simple_enc **senc, uint64_t curr_sample, uint32_t samples);
+
+/*Find a done encode matching curr_sample/samples without taking it, NULL if there isn't one*/
+simple_enc *spec_peek(spec_cache *c, uint64_t curr_sample, uint32_t samples);
+
+/*Free all slots for encodes starting before a sample, ie input that has been committed to the queue*/
+void spec_discard(spec_cache *c, uint64_t before);
+
+/*Free all slots for encodes that don't start at one of start_cnt samples*/
+void spec_keep(spec_cache *c, const uint64_t *start, size_t start_cnt);
+
+void spec_dealloc(spec_cache *c);
+
+void mode_boilerplate_init(flac_settings *set, clock_t *cstart, queue *q, stats *stat, input *in);
 void mode_boilerplate_finish(flac_settings *set, clock_t *cstart, queue *q, stats *stat, input *in, output *out);
 
 #endif
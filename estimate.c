@@ -0,0 +1,104 @@
+#include "estimate.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*Read sample i of an interleaved 16 bit or 32 bit buffer*/
+static int64_t est_sample(const void *raw, int bps, size_t i){
+	return bps==16?((const int16_t*)raw)[i]:((const int32_t*)raw)[i];
+}
+
+/*Sum |residual| of fixed predictors order 0..4 for one channel of a granule, hist carries the previous 4 samples between calls*/
+static void est_residual(const void *raw, int bps, size_t stride, size_t cnt, int64_t *hist, uint64_t *acc){
+	size_t i;
+	int64_t v, x1=hist[0], x2=hist[1], x3=hist[2], x4=hist[3], r;
+	for(i=0;i<cnt;++i){
+		v=est_sample(raw, bps, i*stride);
+		acc[0]+=v<0?-v:v;
+		r=v-x1;
+		acc[1]+=r<0?-r:r;
+		r=v-2*x1+x2;
+		acc[2]+=r<0?-r:r;
+		r=v-3*x1+3*x2-x3;
+		acc[3]+=r<0?-r:r;
+		r=v-4*x1+6*x2-4*x3+x4;
+		acc[4]+=r<0?-r:r;
+		x4=x3;
+		x3=x2;
+		x2=x1;
+		x1=v;
+	}
+	hist[0]=x1;
+	hist[1]=x2;
+	hist[2]=x3;
+	hist[3]=x4;
+}
+
+void est_build(estimator *e, flac_settings *set, input *in, uint64_t curr_sample, size_t sample_cnt, size_t granule){
+	size_t c, g, k;
+	int64_t hist[8][4];
+	uint64_t acc[EST_ORDERS];
+	size_t width=set->bps==16?2:4;
+	uint8_t *raw;
+
+	assert(granule);
+	assert(set->channels<=8);
+	e->granule=granule;
+	e->loc=curr_sample;
+	e->cnt=sample_cnt/granule;
+	if(e->cnt+1>e->alloc){
+		for(k=0;k<EST_ORDERS;++k)
+			e->sum[k]=realloc(e->sum[k], sizeof(uint64_t)*(e->cnt+1));
+		e->alloc=e->cnt+1;
+	}
+	if(!e->cnt)
+		return;
+
+	raw=((uint8_t*)in->buf)+((curr_sample-in->loc_buffer)*set->channels*width);
+
+	//seed history with the first sample so the start of the range doesn't look like a transient
+	for(c=0;c<(size_t)set->channels;++c){
+		for(k=0;k<4;++k)
+			hist[c][k]=est_sample(raw, set->bps, c);
+	}
+
+	for(k=0;k<EST_ORDERS;++k)
+		e->sum[k][0]=0;
+	for(g=0;g<e->cnt;++g){
+		memset(acc, 0, sizeof(acc));
+		for(c=0;c<(size_t)set->channels;++c){
+			est_residual(raw+(((g*granule*set->channels)+c)*width), set->bps, set->channels, granule, hist[c], acc);
+		}
+		for(k=0;k<EST_ORDERS;++k)
+			e->sum[k][g+1]=e->sum[k][g]+acc[k];
+	}
+}
+
+size_t est_frame(estimator *e, flac_settings *set, uint64_t curr_sample, size_t samples){
+	size_t a, b, k, r, bits, best=SIZE_MAX, n=samples*set->channels;
+	uint64_t s;
+	assert(curr_sample>=e->loc);
+	assert(((curr_sample-e->loc)%e->granule)==0 && (samples%e->granule)==0);
+	a=(curr_sample-e->loc)/e->granule;
+	b=a+(samples/e->granule);
+	assert(b<=e->cnt);
+	for(k=0;k<EST_ORDERS;++k){
+		s=e->sum[k][b]-e->sum[k][a];
+		for(r=0;r<30 && (((uint64_t)n)<<(r+1))<s;++r);//rice parameter ~log2 of mean residual
+		bits=(n*(r+1))+(s>>r)+(k*set->bps*set->channels);//rice coded residual plus warmup samples
+		if(bits<best)
+			best=bits;
+	}
+	return 8+set->channels+((best+7)/8);//plus rough frame/subframe header overhead
+}
+
+void est_dealloc(estimator *e){
+	size_t k;
+	for(k=0;k<EST_ORDERS;++k){
+		free(e->sum[k]);
+		e->sum[k]=NULL;
+	}
+	e->alloc=0;
+	e->cnt=0;
+}
@@ -0,0 +1,24 @@
+/*Cheap frame size estimation from fixed predictor residuals, used to screen analysis candidates before doing real encodes*/
+#ifndef ESTIMATE
+#define ESTIMATE
+
+#include "common.h"
+
+#define EST_ORDERS 5
+
+typedef struct{
+	uint64_t *sum[EST_ORDERS];//prefix sums of |residual| per granule, one array per fixed predictor order 0..4
+	uint64_t loc;//global sample index the prefix sums start at
+	size_t granule, cnt, alloc;//cnt granules are available
+} estimator;
+
+/*Build prefix sums over sample_cnt samples of buffered input starting at curr_sample, in units of granule samples
+Any partial granule at the end is ignored*/
+void est_build(estimator *e, flac_settings *set, input *in, uint64_t curr_sample, size_t sample_cnt, size_t granule);
+
+/*Estimated encoded size in bytes of a frame in O(1). curr_sample and samples must be granule aligned and within the built range*/
+size_t est_frame(estimator *e, flac_settings *set, uint64_t curr_sample, size_t samples);
+
+void est_dealloc(estimator *e);
+
+#endif
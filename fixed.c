@@ -8,11 +8,12 @@ int fixed_main(input *in, output *out, flac_settings *set){
 	stats stat={0};
 
 	simple_enc *a;
-	mode_boilerplate_init(set, &cstart, &q, &stat);
+	mode_boilerplate_init(set, &cstart, &q, &stat, in);
 
 	_if((set->blocks_count!=1), "Fixed blocking strategy cannot use multiple block sizes");
 	_if((set->tweak), "Fixed blocking strategy cannot tweak");
 	_if((set->merge), "Fixed blocking strategy cannot merge");
+	_if((set->resegment), "Fixed blocking strategy cannot resegment");
 	_if((set->diff_comp_settings), "Fixed blocking strategy cannot have different comp settings");
 
 	a=calloc(1, sizeof(simple_enc));
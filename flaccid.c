@@ -1,5 +1,6 @@
 #include "FLAC/stream_encoder.h"
 
+#include "beam.h"
 #include "chunk.h"
 #include "common.h"
 #include "fixed.h"
@@ -8,6 +9,7 @@
 #include "load.h"
 #include "peakset.h"
 #include "seektable.h"
+#include "transient.h"
 
 #include <getopt.h>
 #include <stdlib.h>
@@ -20,6 +22,10 @@ char *help=
 	"  complex interface (numerous settings allowing full customisation)\n"
 	"\nOptions:\n"
 	"  [General]\n"
+	" --decision-log path : Write every candidate frame gset, gasc, chunk, merge and\n"
+	"                       tweak decided on to path as CSV, with whether it was\n"
+	"                       chosen, and every frame written as source \"output\".\n"
+	"                       Columns are source,outcome,start,samples,bytes\n"
 	" --in infile : Source. Use - to specify piping from stdin. Valid extensions are\n"
 	"               .wav for wav format, .flac for flac format, .bin for raw CDDA\n"
 	" --input-format format : Force input to be treated as a particular format.\n"
@@ -39,18 +45,39 @@ char *help=
 	"                         This is settable from simple or complex interface as\n"
 	"                         it mainly allows RAM usage to be customised\n"
 	" --preserve-flac-metadata: Preserve metadata from flac input, excluding padding\n"
+	" --progress secs : Report samples processed, realtime factor, compression ratio\n"
+	"                   so far and ETA (when the input length is known) every secs\n"
+	"                   seconds. Off by default\n"
+	" --progress-file path : Write progress to path instead of stderr, overwriting\n"
+	"                        it each time so it always holds the latest line.\n"
+	"                        Needs --progress\n"
 	" --queue size : Number of frames in output queue (default 16), when output\n"
 	"                queue is full it gets flushed. Tweak/merge acting on the output\n"
 	"                queue and batching of output encoding allows multithreading\n"
 	"                even if the mode used is single-threaded. This is settable from\n"
 	"                simple or complex interface as it mainly allows RAM usage to be\n"
 	"                customised\n"
+	" --queue-overlap num : Number of frames kept in the output queue when it is\n"
+	"                       flushed (default 0), they are written with the next\n"
+	"                       flush so merge/tweak can act across the boundary. Must\n"
+	"                       be smaller than --queue\n"
 	" --seektable val : Defines if and how a seektable is generated:\n"
 	"                  -1 (default): Adapt to input if input size is known (most\n"
 	"                                flac/wav has total_sample_cnt in the header),\n"
 	"                                else use 100 seekpoints\n"
 	"                   0          : No seektable\n"
 	"                   n          : n seekpoints\n"
+	" --segments num : Split input into num independent segments at quiet points and\n"
+	"                  analyse them concurrently (gasc and gset only, default 1).\n"
+	"                  Costs a little efficiency at each segment seam in exchange\n"
+	"                  for analysis that scales with --workers. This is settable\n"
+	"                  from simple or complex interface\n"
+	" --stats-json path : Also write settings, per-phase wall time and cpu time per\n"
+	"                     thread, per-thread effort, the blocksize histogram,\n"
+	"                     merge/tweak savings per pass and peak RSS to path as JSON\n"
+	" --trace path : Record every encode, read, write, flush, merge/tweak pass and\n"
+	"                barrier wait per thread to path in Chrome trace format, for\n"
+	"                chrome://tracing or Perfetto\n"
 	" --workers integer : The maximum number of threads to use\n"
 	"\n  [Simple interface]\n"
 	" --preset num[extra] : A preset optionally appended with extra flac settings\n"
@@ -89,7 +116,9 @@ char *help=
 	" --outputalt-comp comp_string : Alternate output compression settings\n"
 	"    [Complex flaccid settings]\n"
 	" --mode mode : Which variable-blocksize algorithm to use for analysis. Valid\n"
-	"               modes: fixed, peakset, gasc, chunk, gset\n"
+	"               modes: fixed, peakset, gasc, chunk, gset, transient, beam\n"
+	" --beam num : Number of partial segmentations beam mode keeps (default 4).\n"
+	"              1 is close to gset, larger is slower and closer to peakset\n"
 	" --blocksize-list block,list : Blocksizes that a mode is allowed to use for\n"
 	"                               analysis. Different modes have different\n"
 	"                               constraints on valid combinations\n"
@@ -97,6 +126,28 @@ char *help=
 	" --blocksize-limit-upper limit : Maximum blocksize a frame can be\n"
 	" --merge threshold : If >0 enables merge passes, iterates until a pass saves\n"
 	"                     less than threshold bytes. 0 disables merging\n"
+	" --merge-span num : Most adjacent frames a single merge can combine (default\n"
+	"                    4), limited by --blocksize-limit-upper\n"
+	" --peakset-coarse comp_string : Peakset first fills its grid using these cheap\n"
+	"                                compression settings, or \"est\" for a fixed\n"
+	"                                predictor size estimate, then only frames on\n"
+	"                                paths within --peakset-tolerance of the best\n"
+	"                                get a real analysis encode. Unset by default\n"
+	" --peakset-tolerance bytes : How many bytes worse than the best coarse path a\n"
+	"                             path can be for its frames to be kept (default\n"
+	"                             64). Larger is slower and closer to full peakset\n"
+	" --resegment : Enables a resegment pass on the output queue before merge/tweak\n"
+	" --screen num : If >0 enables screening, candidate frames are first estimated\n"
+	"                cheaply from fixed predictor residuals and only the num most\n"
+	"                efficient per decision get a real analysis encode. Used by\n"
+	"                gset and peakset (peakset always encodes the smallest\n"
+	"                blocksize). 0 disables screening (default)\n"
+	" --transient-db num : Transient mode detection threshold in dB (default 6). A\n"
+	"                      frame boundary is placed where energy rises or spectral\n"
+	"                      tilt changes by at least this much between granules\n"
+	" --transient-verify : Transient mode tests every detected split with an\n"
+	"                      encode of the frames either side merged, removing\n"
+	"                      splits that don't pay for themselves\n"
 	" --tweak threshold : If >0 enables tweak passes, iterates until a pass saves\n"
 	"                     less than threshold bytes. 0 disables tweaking\n"
 	"\nModes:\n"
@@ -105,7 +156,9 @@ char *help=
 	" peakset: Find the optimal permutation of frames for a given blocksize list.\n"
 	"          Truly optimal if analysis settings are the same as output settings.\n"
 	"          Tweak/merge passes can still be a benefit as they can use blocksizes\n"
-	"          not on the list\n"
+	"          not on the list. Blocksizes don't need to be multiples of each\n"
+	"          other, the search runs on a grid at their greatest common divisor\n"
+	"          so a fine grid (ie 1024,1152,1536) costs more encodes and RAM\n"
 	" gasc:  To find the next frame, test larger and larger blocksizes until\n"
 	"        efficiency drops (then pick previous). Typically better than gset\n"
 	" chunk: Process input as chunks, a chunk evenly subdivides the input by building\n"
@@ -113,19 +166,40 @@ char *help=
 	"        The root has a range of the maximum blocksize in the list\n"
 	" gset:  Test all from a set of blocksizes and greedily pick the most efficient\n"
 	"        as the next frame\n"
+	" transient: Place frame boundaries directly from cheap signal features instead\n"
+	"            of encoding candidates. Input is cut into granules of the smallest\n"
+	"            blocksize, a boundary goes wherever energy rises or spectral tilt\n"
+	"            changes by --transient-db, and the regions between are filled with\n"
+	"            the largest blocksizes that fit. Blocksizes must be multiples of\n"
+	"            the smallest. No analysis encodes unless --transient-verify, merge\n"
+	"            or tweak need frame sizes\n"
+	" beam:  Keep the --beam best partial segmentations ranked by bytes per sample\n"
+	"        and extend each with every blocksize from the list. Segmentations\n"
+	"        reaching the same sample are deduplicated, frames all agree on are\n"
+	"        output. Any blocksize list works\n"
 	"\nAdditional passes:\n"
+	" resegment: Treats the output queue as a window and picks the best\n"
+	"            segmentation from split points at every existing frame boundary\n"
+	"            and frame midpoint, in one pass. Candidate frames span up to two\n"
+	"            queued frames and are encoded in parallel. Never worse than the\n"
+	"            queue it started from, merge/tweak can still refine the result\n"
 	" tweak: Adjusts where adjacent frames are split to look for a more efficient\n"
-	"        encoding. Every pass uses a smaller and smaller offset as we try and\n"
-	"        get closer to optimal. Multithreaded, acts on the output queue and can\n"
-	"        be sped up at a minor efficiency loss by using a smaller queue\n"
-	" merge: Merges adjacent frames to see if the result is more efficient. Best used\n"
+	"        encoding. Each pair's split is searched coarse to fine with every\n"
+	"        offset of a round encoded in parallel, picking the best set of pairs\n"
+	"        not sharing a frame each pass. Multithreaded, acts on the output\n"
+	"        queue and can be sped up at a minor efficiency loss by using a\n"
+	"        smaller queue\n"
+	" merge: Merges runs of adjacent frames to see if the result is more efficient,\n"
+	"        picking the best set of non-overlapping merges each pass. Best used\n"
 	"        with --lax for lots of merging headroom, a sane subset encoding is\n"
 	"        unlikely to see much if any benefit as subset is limited to a blocksize\n"
 	"        of 4608. Multithreaded, acts on the output queue and can be sped up at a\n"
 	"        minor efficiency loss by using a smaller queue\n"
 	"\nMode complexity:\n"
-	" O(1): Fixed mode encodes every sample once\n"
+	" O(1): Fixed mode encodes every sample once, transient mode too unless\n"
+	"       analysis encodes are needed\n"
 	" O(blocksize_count): chunk, gset, gasc (upper bound)\n"
+	" O(blocksize_count*beam): beam (upper bound, beams that meet share encodes)\n"
 	" O(blocksize_count^2): peakset (when blocksizes are contiguous multiples of the\n"
 	"                       smallest blocksize. (n*(n+1))/2\n"
 	"\nCompression settings format:\n"
@@ -175,8 +249,8 @@ static void preset_check(flac_settings *set, char *setting){
 }
 
 int main(int argc, char *argv[]){
-	int (*encoder[6])(input*, output*, flac_settings*)={chunk_main, gset_main, peak_main, gasc_main, fixed_main, NULL};
-	char *blocklist_str=NULL, *ipath=NULL, *opath=NULL;
+	int (*encoder[8])(input*, output*, flac_settings*)={chunk_main, gset_main, peak_main, gasc_main, fixed_main, transient_main, beam_main, NULL};
+	char *blocklist_str=NULL, *ipath=NULL, *opath=NULL, *trace_path=NULL, *decision_path=NULL;
 	flac_settings set={0};
 	input in={0};
 	output out={0};
@@ -196,13 +270,16 @@ int main(int argc, char *argv[]){
 	static struct option long_options[]={
 		{"analysis-apod", required_argument, 0, 259},
 		{"analysis-comp", required_argument, 0, 256},
+		{"beam", required_argument, 0, 286},
 		{"blocksize-list",	required_argument, 0, 258},
 		{"blocksize-limit-lower",	required_argument, 0, 263},
 		{"blocksize-limit-upper",	required_argument, 0, 264},
+		{"decision-log", required_argument, 0, 294},
 		{"help", no_argument, 0, 'h'},
 		{"in", required_argument, 0, 'i'},
 		{"lax", no_argument, 0, 272},
 		{"merge",	required_argument, 0, 265},
+		{"merge-span", required_argument, 0, 288},
 		{"mode", required_argument, 0, 'm'},
 		{"no-md5", no_argument, 0, 271},
 		{"no-seek", no_argument, 0, 274},
@@ -213,12 +290,24 @@ int main(int argc, char *argv[]){
 		{"outperc", required_argument, 0, 269},
 		{"outputalt-apod", required_argument, 0, 267},
 		{"outputalt-comp", required_argument, 0, 268},
+		{"peakset-coarse", required_argument, 0, 284},
+		{"peakset-tolerance", required_argument, 0, 285},
 		{"peakset-window", required_argument, 0, 273},
 		{"preserve-flac-metadata", no_argument, 0, 279},
 		{"preset", required_argument, 0, 276},
 		{"preset-apod", required_argument, 0, 277},
+		{"progress", required_argument, 0, 292},
+		{"progress-file", required_argument, 0, 293},
 		{"queue", required_argument, 0, 270},
+		{"queue-overlap", required_argument, 0, 289},
+		{"resegment", no_argument, 0, 287},
+		{"screen", required_argument, 0, 280},
 		{"seektable", required_argument, 0, 278},
+		{"segments", required_argument, 0, 281},
+		{"stats-json", required_argument, 0, 290},
+		{"trace", required_argument, 0, 291},
+		{"transient-db", required_argument, 0, 282},
+		{"transient-verify", no_argument, 0, 283},
 		{"tweak", required_argument, 0, 261},
 		{"workers", required_argument, 0, 'w'},
 		{"wildcard", required_argument, 0, 266},
@@ -229,6 +318,7 @@ int main(int argc, char *argv[]){
 	set.apod_anal=NULL;
 	set.apod_output=NULL;
 	set.apod_outputalt=NULL;
+	set.beam=4;
 	set.blocksize_limit_lower=256;
 	set.blocksize_limit_upper=0;
 	set.blocksize_max=4096;
@@ -241,17 +331,31 @@ int main(int argc, char *argv[]){
 	set.diff_comp_settings=0;
 	set.lax=0;
 	set.merge=0;
+	set.merge_span=4;
+	set.queue_overlap=0;
 	set.minf=UINT32_MAX;
 	set.maxf=0;
 	set.md5=1;
 	set.mode=-1;
 	set.outperc=100;
+	set.coarse_tol=64;
+	set.comp_coarse=NULL;
+	set.stats_json=NULL;
+	set.trace=NULL;
+	set.progress=0;
+	set.progress_file=NULL;
+	set.decision_log=NULL;
 	set.peakset_window=26;
 	set.preserve_flac_metadata=0;
 	set.queue_size=16;
 	set.sample_rate=44100;
+	set.resegment=0;
+	set.screen=0;
 	set.seek=1;
 	set.seektable=-1;
+	set.segments=1;
+	set.transient_db=6;
+	set.transient_verify=0;
 	set.tweak=0;
 	set.wildcard=0;
 	set.work_count=1;
@@ -282,6 +386,10 @@ int main(int argc, char *argv[]){
 					set.mode=3;
 				else if(strcmp(optarg, "fixed")==0)
 					set.mode=4;
+				else if(strcmp(optarg, "transient")==0)
+					set.mode=5;
+				else if(strcmp(optarg, "beam")==0)
+					set.mode=6;
 				else
 					_("Unknown mode");
 				break;
@@ -485,6 +593,83 @@ int main(int argc, char *argv[]){
 				set.preserve_flac_metadata=1;
 				break;
 
+			case 280:
+				preset_check(&set, "--screen");
+				_if((atoi(optarg)<0), "Invalid screen setting");
+				set.screen=atoi(optarg);
+				break;
+
+			case 281:
+				_if((atoi(optarg)<1), "Invalid --segments setting");
+				set.segments=atoi(optarg);
+				break;
+
+			case 282:
+				preset_check(&set, "--transient-db");
+				_if((atoi(optarg)<1), "Invalid --transient-db setting");
+				set.transient_db=atoi(optarg);
+				break;
+
+			case 283:
+				preset_check(&set, "--transient-verify");
+				set.transient_verify=1;
+				break;
+
+			case 284:
+				preset_check(&set, "--peakset-coarse");
+				set.comp_coarse=optarg;
+				break;
+
+			case 285:
+				preset_check(&set, "--peakset-tolerance");
+				_if((atoi(optarg)<0), "Invalid --peakset-tolerance setting");
+				set.coarse_tol=atoi(optarg);
+				break;
+
+			case 286:
+				preset_check(&set, "--beam");
+				_if((atoi(optarg)<1), "Invalid --beam setting");
+				set.beam=atoi(optarg);
+				break;
+
+			case 287:
+				preset_check(&set, "--resegment");
+				set.resegment=1;
+				break;
+
+			case 288:
+				preset_check(&set, "--merge-span");
+				_if((atoi(optarg)<2), "Invalid --merge-span setting (must be at least 2)");
+				set.merge_span=atoi(optarg);
+				break;
+
+			case 289:
+				preset_check(&set, "--queue-overlap");
+				_if((atoi(optarg)<0), "Queue overlap cannot be negative");
+				set.queue_overlap=atoi(optarg);
+				break;
+
+			case 290:
+				set.stats_json=optarg;
+				break;
+
+			case 291:
+				trace_path=optarg;
+				break;
+
+			case 292:
+				_if((atof(optarg)<=0), "Invalid --progress setting (must be a positive number of seconds)");
+				set.progress=atof(optarg);
+				break;
+
+			case 293:
+				set.progress_file=optarg;
+				break;
+
+			case 294:
+				decision_path=optarg;
+				break;
+
 			case '?':
 				_("Unknown option");
 				break;
@@ -496,6 +681,9 @@ int main(int argc, char *argv[]){
 	_if((set.mode==-1), "No mode set, either set a mode manually or choose a preset");
 	_if((!set.seek && set.md5), "Cannot use MD5 if seek is disabled");
 	_if((set.seektable!=0 && !set.seek), "Cannot add a seektable if seek is disabled");
+	_if((set.segments>1 && set.mode!=MODE_GASC && set.mode!=MODE_GSET), "--segments is only supported by gasc and gset");
+	_if((set.queue_overlap>=set.queue_size), "--queue-overlap must be smaller than --queue");
+	_if((set.progress_file && !set.progress), "--progress-file needs --progress");
 
 	if(!blocklist_str){//valid defaults for the different modes
 		if(set.mode==MODE_GASC)
@@ -516,7 +704,17 @@ int main(int argc, char *argv[]){
 	set.diff_comp_settings=set.diff_comp_settings?set.diff_comp_settings:(!set.apod_anal && set.apod_output);
 	set.diff_comp_settings=set.diff_comp_settings?set.diff_comp_settings:(set.apod_anal && set.apod_output && strcmp(set.apod_anal, set.apod_output)!=0);
 
+	if(trace_path)
+		set.trace=trace_open(trace_path, set.work_count);
+	if(decision_path){
+		set.decision_log=fopen(decision_path, "w");
+		_if((!set.decision_log), "Could not open --decision-log file");
+		fprintf(set.decision_log, "source,outcome,start,samples,bytes\n");
+	}
 	encoder[set.mode](&in, &out, &set);
+	trace_close(set.trace);
+	if(set.decision_log)
+		fclose(set.decision_log);
 	fprintf(stderr, "\t%s\n", ipath);
 
 	if(set.seek){
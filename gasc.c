@@ -1,16 +1,127 @@
 #include "gasc.h"
+#include "segment.h"
 
 #include <assert.h>
 #include <stdlib.h>
 
+/*Request a speculative encode if it fits in the available input and could be a valid gasc frame*/
+static size_t gasc_speculate(spec_cache *spec, flac_settings *set, input *in, uint64_t curr_sample, size_t samples){
+	if(samples>(size_t)set->blocksize_limit_upper || curr_sample+samples>in->loc_analysis+in->sample_cnt)
+		return 0;
+	return spec_request(spec, curr_sample, samples);
+}
+
+/*Analyse via the speculation cache. On a miss with multiple workers, encode the requested frame along with the
+growth steps that could follow it (b and ab of each step) and the start of the next frame for each step the current
+frame could end on, as one parallel batch. Decisions are made exactly as if every encode was done on demand so
+output is identical, mispredicted encodes are just discarded*/
+static void gasc_analyse(spec_cache *spec, simple_enc **senc, flac_settings *set, input *in, uint32_t samples, uint64_t curr_sample, stats *stat){
+	size_t m, pending=1;
+	uint64_t start=in->loc_analysis;
+	if(spec_take(spec, senc, curr_sample, samples))
+		return;
+	if(set->work_count>1)
+		in->input_read(in, 2*set->blocksize_limit_upper);
+	if(set->work_count==1 || curr_sample+samples>in->loc_analysis+in->sample_cnt){//nothing to gain or eof, encode directly
+		simple_enc_analyse(*senc, set, in, samples, curr_sample, stat);
+		return;
+	}
+	spec_discard(spec, start);
+	spec_request(spec, curr_sample, samples);
+	m=(curr_sample==start)?(samples/set->blocks[0])-1:(curr_sample-start)/set->blocks[0];
+	for(;pending<(size_t)set->work_count && (m*set->blocks[0])<=(size_t)set->blocksize_limit_upper;++m){
+		pending+=gasc_speculate(spec, set, in, start+(m*set->blocks[0]), set->blocks[0]);//b of step m
+		pending+=gasc_speculate(spec, set, in, start, (m+1)*set->blocks[0]);//ab of step m
+		pending+=gasc_speculate(spec, set, in, start+(m*set->blocks[0]), 2*set->blocks[0]);//ab of next frame if a ends at step m
+	}
+	spec_run(spec, set, in, stat);
+	_if((!spec_take(spec, senc, curr_sample, samples)), "gasc speculation failed to encode requested frame");
+}
+
+enum{GASC_A, GASC_AB, GASC_GROW};
+
+/*One gasc decision on frame a, the blocks[0] after it b and both as one frame ab, where ab can grow to at most room
+samples. Returns whether to output a, output ab or grow a into ab, logging the outcome*/
+static int gasc_decide(flac_settings *set, simple_enc *a, simple_enc *b, simple_enc *ab, size_t room){
+	if((a->outbuf_size+b->outbuf_size)<ab->outbuf_size){//dump a naturally
+		decision_log(set, "gasc", 1, a->curr_sample, a->sample_cnt, a->outbuf_size);
+		decision_log(set, "gasc", 0, ab->curr_sample, ab->sample_cnt, ab->outbuf_size);
+		return GASC_A;
+	}
+	decision_log(set, "gasc", 0, a->curr_sample, a->sample_cnt, a->outbuf_size);
+	if(ab->sample_cnt+set->blocks[0]>room){//dump ab as hit the limit
+		decision_log(set, "gasc", 1, ab->curr_sample, ab->sample_cnt, ab->outbuf_size);
+		return GASC_AB;
+	}
+	return GASC_GROW;
+}
+
+/*Sequential gasc over one segment of input for segment_main. Frames are cut short at the end of the segment*/
+static void gasc_segment(seg_frames *fr, flac_settings *set, input *in, uint64_t curr_sample, size_t samples, stats *stat){
+	simple_enc *a, *ab, *b, *swap;
+	int fresh=1;
+	uint64_t end=curr_sample+samples;
+
+	a =calloc(1, sizeof(simple_enc));
+	b =calloc(1, sizeof(simple_enc));
+	ab=calloc(1, sizeof(simple_enc));
+
+	while(end-curr_sample>=2*(uint64_t)set->blocks[0]){
+		if(fresh){//start a new frame from scratch
+			simple_enc_analyse(a , set, in, set->blocks[0], curr_sample, stat);
+			simple_enc_analyse(b , set, in, set->blocks[0], curr_sample+set->blocks[0], stat);
+			simple_enc_analyse(ab, set, in, 2*set->blocks[0], curr_sample, stat);
+			fresh=0;
+		}
+		switch(gasc_decide(set, a, b, ab, (end-curr_sample<(uint64_t)set->blocksize_limit_upper)?end-curr_sample:(uint64_t)set->blocksize_limit_upper)){
+			case GASC_A:
+				segment_add(fr, curr_sample, a->sample_cnt, a->outbuf_size);
+				curr_sample+=a->sample_cnt;
+				swap=a;
+				a=b;
+				b=swap;
+				if(end-curr_sample>=2*(uint64_t)set->blocks[0]){
+					simple_enc_analyse(b, set, in, set->blocks[0], curr_sample+set->blocks[0], stat);
+					simple_enc_analyse(ab, set, in, 2*set->blocks[0], curr_sample, stat);
+				}
+				break;
+			case GASC_AB:
+				segment_add(fr, curr_sample, ab->sample_cnt, ab->outbuf_size);
+				curr_sample+=ab->sample_cnt;
+				fresh=1;
+				break;
+			default:
+				swap=a;
+				a=ab;
+				ab=swap;
+				simple_enc_analyse(b, set, in, set->blocks[0], curr_sample+a->sample_cnt, stat);
+				simple_enc_analyse(ab, set, in, a->sample_cnt+set->blocks[0], curr_sample, stat);
+		}
+	}
+	if(end>curr_sample){//rest of segment as one frame
+		simple_enc_analyse(a, set, in, end-curr_sample, curr_sample, stat);
+		segment_add(fr, curr_sample, end-curr_sample, a->outbuf_size);
+	}
+	simple_enc_dealloc(a);
+	simple_enc_dealloc(b);
+	simple_enc_dealloc(ab);
+}
+
 int gasc_main(input *in, output *out, flac_settings *set){
 	clock_t cstart;
 	queue q;
 	stats stat={0};
 
 	simple_enc *a, *ab, *b, *swap;
+	spec_cache spec={0};
+
+	if(set->segments>1){
+		_if((set->blocks_count!=1), "gasc cannot use multiple block sizes");
+		_if((2*set->blocks[0]>set->blocksize_limit_upper), "gasc needs an upper blocksize limit at least twice that of the blocksize used");
+		return segment_main(in, out, set, gasc_segment, SEGMENT_BLOCKS*set->blocks[0]);
+	}
 
-	mode_boilerplate_init(set, &cstart, &q, &stat);
+	mode_boilerplate_init(set, &cstart, &q, &stat, in);
 
 	_if((set->blocks_count!=1), "gasc cannot use multiple block sizes");
 	_if((2*set->blocks[0]>set->blocksize_limit_upper), "gasc needs an upper blocksize limit at least twice that of the blocksize used");
@@ -21,44 +132,46 @@ int gasc_main(input *in, output *out, flac_settings *set){
 
 	in->input_read(in, set->blocksize_limit_upper);
 	if(!simple_enc_eof(&q, &a, set, in, 2*set->blocks[0], &stat, out)){//if not eof, init
-		simple_enc_analyse(a , set, in, set->blocks[0], 0, &stat);
-		simple_enc_analyse(b , set, in, set->blocks[0], set->blocks[0], &stat);
-		simple_enc_analyse(ab, set, in, 2*set->blocks[0], 0, &stat);
+		gasc_analyse(&spec, &a, set, in, set->blocks[0], 0, &stat);
+		gasc_analyse(&spec, &b, set, in, set->blocks[0], set->blocks[0], &stat);
+		gasc_analyse(&spec, &ab, set, in, 2*set->blocks[0], 0, &stat);
 	}
 
 	while(in->sample_cnt){
-		if((a->outbuf_size+b->outbuf_size)<ab->outbuf_size){//dump a naturally
-			a=simple_enc_out(&q, a, set, in, &stat, out);
-			in->input_read(in, set->blocksize_limit_upper);
-			if(!simple_enc_eof(&q, &a, set, in, 2*set->blocks[0], &stat, out)){//if next !eof, iterate
+		switch(gasc_decide(set, a, b, ab, set->blocksize_limit_upper)){
+			case GASC_A:
+				a=simple_enc_out(&q, a, set, in, &stat, out);
+				in->input_read(in, set->blocksize_limit_upper);
+				if(!simple_enc_eof(&q, &a, set, in, 2*set->blocks[0], &stat, out)){//if next !eof, iterate
+					swap=a;
+					a=b;
+					b=swap;
+					gasc_analyse(&spec, &b, set, in, set->blocks[0], in->loc_analysis+set->blocks[0], &stat);
+					gasc_analyse(&spec, &ab, set, in, 2*set->blocks[0], in->loc_analysis, &stat);
+				}
+				break;
+			case GASC_AB:
+				ab=simple_enc_out(&q, ab, set, in, &stat, out);
+				in->input_read(in, set->blocksize_limit_upper);
+				if(!simple_enc_eof(&q, &a, set, in, 2*set->blocks[0], &stat, out)){//if next !eof, iterate
+					gasc_analyse(&spec, &a, set, in, set->blocks[0], in->loc_analysis, &stat);
+					gasc_analyse(&spec, &b, set, in, set->blocks[0], in->loc_analysis+set->blocks[0], &stat);
+					gasc_analyse(&spec, &ab, set, in, 2*set->blocks[0], in->loc_analysis, &stat);
+				}
+				break;
+			default:
+				_if(((ab->sample_cnt+set->blocks[0]>in->sample_cnt) && !simple_enc_eof(&q, &a, set, in, in->sample_cnt+1, &stat, out)), "Failed to finalise in-progress frame");//eof mid-frame
 				swap=a;
-				a=b;
-				b=swap;
-				simple_enc_analyse(b, set, in, set->blocks[0], in->loc_analysis+set->blocks[0], &stat);
-				simple_enc_analyse(ab, set, in, 2*set->blocks[0], in->loc_analysis, &stat);
-			}
-		}
-		else if(ab->sample_cnt+set->blocks[0]>set->blocksize_limit_upper){//dump ab as hit upper limit
-			ab=simple_enc_out(&q, ab, set, in, &stat, out);
-			in->input_read(in, set->blocksize_limit_upper);
-			if(!simple_enc_eof(&q, &a, set, in, 2*set->blocks[0], &stat, out)){//if next !eof, iterate
-				simple_enc_analyse(a, set, in, set->blocks[0], in->loc_analysis, &stat);
-				simple_enc_analyse(b, set, in, set->blocks[0], in->loc_analysis+set->blocks[0], &stat);
-				simple_enc_analyse(ab, set, in, 2*set->blocks[0], in->loc_analysis, &stat);
-			}
-		}
-		else{//iterate
-			_if(((ab->sample_cnt+set->blocks[0]>in->sample_cnt) && !simple_enc_eof(&q, &a, set, in, in->sample_cnt+1, &stat, out)), "Failed to finalise in-progress frame");//eof mid-frame
-			swap=a;
-			a=ab;
-			ab=swap;
-			simple_enc_analyse(b, set, in, set->blocks[0], in->loc_analysis+a->sample_cnt, &stat);
-			simple_enc_analyse(ab, set, in, a->sample_cnt+set->blocks[0], in->loc_analysis, &stat);
+				a=ab;
+				ab=swap;
+				gasc_analyse(&spec, &b, set, in, set->blocks[0], in->loc_analysis+a->sample_cnt, &stat);
+				gasc_analyse(&spec, &ab, set, in, a->sample_cnt+set->blocks[0], in->loc_analysis, &stat);
 		}
 	}
 	mode_boilerplate_finish(set, &cstart, &q, &stat, in, out);
 	simple_enc_dealloc(a);
 	simple_enc_dealloc(b);
 	simple_enc_dealloc(ab);
+	spec_dealloc(&spec);
 	return 0;
 }
@@ -1,44 +1,183 @@
+#include "estimate.h"
 #include "gset.h"
+#include "segment.h"
 
 #include <assert.h>
 #include <stdlib.h>
 
+/*Mark the candidates at curr_sample that fit before end. Unless tail is set, blocksizes that would leave a tail too
+small to be a frame before end are skipped. With screening every candidate is estimated and only the set->screen
+most efficient are kept, est must have been built from curr_sample or earlier*/
+static void gset_candidates(estimator *est, flac_settings *set, int screen, uint64_t curr_sample, uint64_t end, int tail, double *esteff, int *use){
+	double best;
+	size_t i, j, pick;
+	for(i=0;i<set->blocks_count;++i){
+		use[i]=curr_sample+set->blocks[i]<=end && (tail || curr_sample+set->blocks[i]==end || end-(curr_sample+set->blocks[i])>=16);
+		if(!screen)
+			continue;
+		if(use[i] && curr_sample+set->blocks[i]<=est->loc+(est->cnt*est->granule))
+			esteff[i]=((double)est_frame(est, set, curr_sample, set->blocks[i]))/set->blocks[i];
+		else
+			esteff[i]=9999.0;
+		use[i]=0;
+	}
+	for(j=0;screen && j<(size_t)set->screen;++j){
+		best=9998.0;
+		pick=set->blocks_count;
+		for(i=0;i<set->blocks_count;++i){
+			if(!use[i] && esteff[i]<best){
+				best=esteff[i];
+				pick=i;
+			}
+		}
+		if(pick==set->blocks_count)
+			break;
+		use[pick]=1;
+	}
+}
+
+/*Pick the most efficient candidate at curr_sample, size[i] is the encoded size of blocks[i] or 0 if it wasn't
+encoded. Logs every candidate, returns blocks_count if there were none*/
+static size_t gset_decide(flac_settings *set, uint64_t curr_sample, size_t *size){
+	double besteff=9998.0, eff;
+	size_t best=set->blocks_count, i;
+	for(i=0;i<set->blocks_count;++i){
+		if(!size[i])
+			continue;
+		eff=size[i];
+		eff/=set->blocks[i];
+		if(eff<besteff){
+			besteff=eff;
+			best=i;
+		}
+	}
+	for(i=0;i<set->blocks_count;++i){
+		if(size[i])
+			decision_log(set, "gset", i==best, curr_sample, set->blocks[i], size[i]);
+	}
+	return best;
+}
+
+/*Request the marked candidates at curr_sample*/
+static void gset_request(spec_cache *spec, flac_settings *set, uint64_t curr_sample, int *use){
+	size_t i;
+	for(i=0;i<set->blocks_count;++i){
+		if(use[i])
+			spec_request(spec, curr_sample, set->blocks[i]);
+	}
+}
+
+/*Sequential gset over one segment of input for segment_main*/
+static void gset_segment(seg_frames *fr, flac_settings *set, input *in, uint64_t curr_sample, size_t samples, stats *stat){
+	double *esteff;
+	estimator est={0};
+	int last, *use, screen;
+	simple_enc *work;
+	size_t best, i, *size;
+	uint64_t end=curr_sample+samples;
+
+	last=(end==in->loc_analysis+in->sample_cnt);//the eof segment ends like gset_main, with a short last frame
+	screen=set->screen && (size_t)set->screen<set->blocks_count;
+	if(screen)
+		est_build(&est, set, in, curr_sample, samples, blocksize_gcd(set));
+	esteff=malloc(sizeof(double)*set->blocks_count);
+	use=malloc(sizeof(int)*set->blocks_count);
+	size=malloc(sizeof(size_t)*set->blocks_count);
+	work=calloc(1, sizeof(simple_enc));
+	while(end-curr_sample>(uint64_t)set->blocks[0]){
+		gset_candidates(&est, set, screen, curr_sample, end, last, esteff, use);
+		for(i=0;i<set->blocks_count;++i){
+			size[i]=0;
+			if(use[i]){
+				simple_enc_analyse(work, set, in, set->blocks[i], curr_sample, stat);
+				size[i]=work->outbuf_size;
+			}
+		}
+		best=gset_decide(set, curr_sample, size);
+		if(best==set->blocks_count)
+			break;
+		segment_add(fr, curr_sample, set->blocks[best], size[best]);
+		curr_sample+=set->blocks[best];
+	}
+	if(end>curr_sample){//partial last frame
+		simple_enc_analyse(work, set, in, end-curr_sample, curr_sample, stat);
+		segment_add(fr, curr_sample, end-curr_sample, work->outbuf_size);
+	}
+	simple_enc_dealloc(work);
+	free(esteff);
+	free(use);
+	free(size);
+	est_dealloc(&est);
+}
+
 int gset_main(input *in, output *out, flac_settings *set){
 	clock_t cstart;
 	queue q;
 	stats stat={0};
 
-	double besteff, *curreff;
+	double *esteff, tr;
+	estimator est={0};
+	int *use, *nextuse, screen;
 	simple_enc **genc;
-	size_t best=0, i;
+	spec_cache spec={0};
+	size_t best, granule, i, lookahead, *size;
+	uint64_t end;
+
+	if(set->segments>1)
+		return segment_main(in, out, set, gset_segment, SEGMENT_BLOCKS*set->blocks[set->blocks_count-1]);
 
-	mode_boilerplate_init(set, &cstart, &q, &stat);
+	mode_boilerplate_init(set, &cstart, &q, &stat, in);
 
 	genc=malloc(sizeof(simple_enc*)*set->blocks_count);
 	for(i=0;i<set->blocks_count;++i)
 		genc[i]=calloc(1, sizeof(simple_enc));
-	curreff=malloc(sizeof(double)*set->blocks_count);
-
-	while(in->input_read(in, set->blocks[set->blocks_count-1])>set->blocks[0]){
-		#pragma omp parallel for num_threads(set->work_count)
-		for(i=0;i<set->blocks_count;++i){//encode all in set
-			if(set->blocks[i]<=in->sample_cnt){//if they don't overflow the input
-				simple_enc_analyse(genc[i], set, in, set->blocks[i], in->loc_analysis, &stat);
-				curreff[i]=genc[i]->outbuf_size;
-				curreff[i]/=set->blocks[i];
+	size=malloc(sizeof(size_t)*set->blocks_count);
+	esteff=malloc(sizeof(double)*set->blocks_count);
+	use=malloc(sizeof(int)*set->blocks_count);
+	nextuse=malloc(sizeof(int)*set->blocks_count);
+	granule=blocksize_gcd(set);
+	screen=set->screen && (size_t)set->screen<set->blocks_count;
+	//with workers to spare also encode the candidates at every place the next frame could start
+	lookahead=(size_t)set->work_count>set->blocks_count?2:1;
+
+	while(in->input_read(in, lookahead*set->blocks[set->blocks_count-1])>(size_t)set->blocks[0]){
+		end=in->loc_analysis+in->sample_cnt;
+		if(screen)
+			est_build(&est, set, in, in->loc_analysis, in->sample_cnt<lookahead*set->blocks[set->blocks_count-1]?in->sample_cnt:lookahead*set->blocks[set->blocks_count-1], granule);
+		gset_candidates(&est, set, screen, in->loc_analysis, end, 1, esteff, use);
+		if(lookahead>1){
+			spec_discard(&spec, in->loc_analysis);
+			gset_request(&spec, set, in->loc_analysis, use);
+			for(i=0;i<set->blocks_count;++i){
+				if(use[i]){
+					gset_candidates(&est, set, screen, in->loc_analysis+set->blocks[i], end, 1, esteff, nextuse);
+					gset_request(&spec, set, in->loc_analysis+set->blocks[i], nextuse);
+				}
+			}
+			spec_run(&spec, set, in, &stat);
+			for(i=0;i<set->blocks_count;++i){
+				size[i]=0;
+				if(use[i]){
+					_if((!spec_take(&spec, genc+i, in->loc_analysis, set->blocks[i])), "gset lookahead failed to encode candidate");
+					size[i]=genc[i]->outbuf_size;
+				}
 			}
-			else
-				curreff[i]=9999.0;
 		}
-		#pragma omp barrier
-		//find the most efficient next block
-		besteff=9998.0;
-		for(i=0;i<set->blocks_count;++i){
-			if(curreff[i]<besteff){
-				besteff=curreff[i];
-				best=i;
+		else{
+			tr=trace_now(set->trace);
+			#pragma omp parallel for num_threads(set->work_count)
+			for(i=0;i<set->blocks_count;++i){//encode all in set
+				size[i]=0;
+				if(use[i]){
+					simple_enc_analyse(genc[i], set, in, set->blocks[i], in->loc_analysis, &stat);
+					size[i]=genc[i]->outbuf_size;
+				}
 			}
+			#pragma omp barrier
+			trace_barrier(set->trace, tr);
 		}
+		best=gset_decide(set, in->loc_analysis, size);
+		assert(best<set->blocks_count);//blocks[0] always fits and is always in the estimated range
 		genc[best]=simple_enc_out(&q, genc[best], set, in, &stat, out);
 	}
 	simple_enc_eof(&q, genc, set, in, in->sample_cnt+1, &stat, out);//partial last frame
@@ -48,6 +187,11 @@ int gset_main(input *in, output *out, flac_settings *set){
 	for(i=0;i<set->blocks_count;++i)
 		simple_enc_dealloc(genc[i]);
 	free(genc);
-	free(curreff);
+	free(size);
+	free(esteff);
+	free(use);
+	free(nextuse);
+	est_dealloc(&est);
+	spec_dealloc(&spec);
 	return 0;
 }
@@ -25,8 +25,11 @@ static int MD5_Update(MD5_CTX* ctx, const unsigned char *d, size_t s){
 }
 #endif
 
-static void MD5_UpdateSamplesRelative(MD5_CTX *ctx, const void *inp, size_t sample_cnt, flac_settings *set){
+static void MD5_UpdateSamplesRelative(input *in, const void *inp, size_t sample_cnt){
+	MD5_CTX *ctx=&(in->ctx);
+	flac_settings *set=in->set;
 	size_t i, j, width;
+	phase_end(in->stat, PHASE_READ);
 	if(set->bps==16)
 		MD5_Update(ctx, inp, sample_cnt*2*set->channels);//16
 	else if(set->bps==32)
@@ -38,6 +41,7 @@ static void MD5_UpdateSamplesRelative(MD5_CTX *ctx, const void *inp, size_t samp
 				MD5_Update(ctx, inp+(i*4*set->channels)+(j*4), width);
 		}
 	}
+	phase_end(in->stat, PHASE_MD5);
 }
 
 /*Input buffer maintains all input being processed
@@ -66,8 +70,13 @@ static void MD5_UpdateSamplesRelative(MD5_CTX *ctx, const void *inp, size_t samp
 //try and read sample_cnt samples from input, if available at least sample_cnt samples unhandled by analysis will be in the buffer
 //also shift buffer to remove samples handled by output buffer
 static size_t input_read_flac(input *in, size_t sample_cnt){
+	double tr;
+	uint64_t start;
 	if(in->sample_cnt>=sample_cnt)
 		return in->sample_cnt;
+	phase_end(in->stat, PHASE_ANAL);
+	tr=trace_now(in->set->trace);
+	start=in->loc_analysis+in->sample_cnt;
 	//max frame is 65535, so overallocating by more means we should always have enough buffer
 	in->buf=realloc(in->buf, ((in->loc_analysis-in->loc_buffer)+sample_cnt+65536)*(in->set->bps==16?2:4)*in->set->channels);
 	while(in->sample_cnt<sample_cnt){
@@ -75,6 +84,8 @@ static size_t input_read_flac(input *in, size_t sample_cnt){
 		if(FLAC__STREAM_DECODER_END_OF_STREAM==FLAC__stream_decoder_get_state(in->dec))
 			break;
 	}
+	trace_add(in->set->trace, "read", tr, start, in->loc_analysis+in->sample_cnt-start);
+	phase_end(in->stat, PHASE_READ);
 	return in->sample_cnt;
 }
 
@@ -83,33 +94,36 @@ static void input_close(input *in){
 		MD5_Final(in->set->hash, &(in->ctx));
 }
 
-//assumes alloc has been done
-static FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *dec, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data){
-	input *in=(input*)client_data;
+void *input_interleave(input *in, const int32_t * const buffer[], size_t samples){
 	size_t i, j, index=0;
 	int16_t *raw16;
 	int32_t *raw32;
-	(void)dec;
 	if(in->set->bps==16){
 		raw16=in->buf;
 		raw16+=(((in->loc_analysis-in->loc_buffer)+in->sample_cnt)*in->set->channels);
-		for(i=0;i<frame->header.blocksize;++i){
+		for(i=0;i<samples;++i){
 			for(j=0;j<in->set->channels;++j)
-				raw16[index++]=(FLAC__int16)buffer[j][i];
+				raw16[index++]=(int16_t)buffer[j][i];
 		}
-		if(in->set->md5)
-			MD5_UpdateSamplesRelative(&(in->ctx), raw16, frame->header.blocksize, in->set);
+		return raw16;
 	}
-	else{
-		raw32=in->buf;
-		raw32+=(((in->loc_analysis-in->loc_buffer)+in->sample_cnt)*in->set->channels);
-		for(i=0;i<frame->header.blocksize;++i){
-			for(j=0;j<in->set->channels;++j)
-				raw32[index++]=buffer[j][i];
-		}
-		if(in->set->md5)
-			MD5_UpdateSamplesRelative(&(in->ctx), raw32, frame->header.blocksize, in->set);
+	raw32=in->buf;
+	raw32+=(((in->loc_analysis-in->loc_buffer)+in->sample_cnt)*in->set->channels);
+	for(i=0;i<samples;++i){
+		for(j=0;j<in->set->channels;++j)
+			raw32[index++]=buffer[j][i];
 	}
+	return raw32;
+}
+
+//assumes alloc has been done
+static FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *dec, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data){
+	input *in=(input*)client_data;
+	void *raw;
+	(void)dec;
+	raw=input_interleave(in, buffer, frame->header.blocksize);
+	if(in->set->md5)
+		MD5_UpdateSamplesRelative(in, raw, frame->header.blocksize);
 	in->sample_cnt+=frame->header.blocksize;
 	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
@@ -295,11 +309,16 @@ static int input_fopen_flac_init(input *in, char *path){
 }
 
 static size_t input_read_wav(input *in, size_t sample_cnt){
+	double tr;
 	int16_t *raw16;
 	int32_t *raw32;
 	size_t amount;
+	uint64_t start;
 	if(in->sample_cnt>=sample_cnt)
 		return in->sample_cnt;
+	phase_end(in->stat, PHASE_ANAL);
+	tr=trace_now(in->set->trace);
+	start=in->loc_analysis+in->sample_cnt;
 	//max frame is 65535, so overallocating by more means we should always have enough buffer
 	in->buf=realloc(in->buf, ((in->loc_analysis-in->loc_buffer)+sample_cnt+65536)*(in->set->bps==16?2:4)*in->set->channels);
 	if(in->set->bps==16){
@@ -307,16 +326,18 @@ static size_t input_read_wav(input *in, size_t sample_cnt){
 		raw16+=(((in->loc_analysis-in->loc_buffer)+in->sample_cnt)*in->set->channels);
 		amount=drwav_read_pcm_frames_s16(&(in->wav), sample_cnt-in->sample_cnt, raw16);
 		if(in->set->md5)
-			MD5_UpdateSamplesRelative(&(in->ctx), raw16, amount, in->set);
+			MD5_UpdateSamplesRelative(in, raw16, amount);
 	}
 	else{//currently broken fix TODO
 		raw32=in->buf;
 		raw32+=(((in->loc_analysis-in->loc_buffer)+in->sample_cnt)*in->set->channels);
 		amount=drwav_read_pcm_frames_s32(&(in->wav), sample_cnt-in->sample_cnt, raw32);
 		if(in->set->md5)
-			MD5_UpdateSamplesRelative(&(in->ctx), raw32, amount, in->set);
+			MD5_UpdateSamplesRelative(in, raw32, amount);
 	}
 	in->sample_cnt+=amount;
+	trace_add(in->set->trace, "read", tr, start, in->loc_analysis+in->sample_cnt-start);
+	phase_end(in->stat, PHASE_READ);
 	return in->sample_cnt;
 }
 
@@ -342,15 +363,22 @@ static int input_fopen_wav(input *in, char *path){
 }
 
 static size_t input_read_cdda(input *in, size_t sample_cnt){
+	double tr;
 	size_t amount;
+	uint64_t start;
 	if(in->sample_cnt>=sample_cnt)
 		return in->sample_cnt;
+	phase_end(in->stat, PHASE_ANAL);
+	tr=trace_now(in->set->trace);
+	start=in->loc_analysis+in->sample_cnt;
 	//max frame is 65535, so overallocating by more means we should always have enough buffer
 	in->buf=realloc(in->buf, ((in->loc_analysis-in->loc_buffer)+sample_cnt+65536)*4);
-	amount=fread(((uint8_t*)in->buf)+(in->loc_analysis-in->loc_buffer)*4, 1, (sample_cnt-in->sample_cnt)*4, in->cdda)/4;
+	amount=fread(((uint8_t*)in->buf)+((in->loc_analysis-in->loc_buffer)+in->sample_cnt)*4, 1, (sample_cnt-in->sample_cnt)*4, in->cdda)/4;
 	if(in->set->md5)
-		MD5_UpdateSamplesRelative(&(in->ctx), ((uint8_t*)in->buf)+(in->loc_analysis-in->loc_buffer)*4, amount, in->set);
+		MD5_UpdateSamplesRelative(in, ((uint8_t*)in->buf)+((in->loc_analysis-in->loc_buffer)+in->sample_cnt)*4, amount);
 	in->sample_cnt+=amount;
+	trace_add(in->set->trace, "read", tr, start, in->loc_analysis+in->sample_cnt-start);
+	phase_end(in->stat, PHASE_READ);
 	return in->sample_cnt;
 }
 
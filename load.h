@@ -8,6 +8,8 @@
 #define INLOC_ANAL ((in->set->bps==16?2:4)*in->set->channels*(in->loc_analysis-in->loc_buffer))
 
 int input_fopen(input *input, char *path, flac_settings *set);
+/*Interleave a decoded frame of per-channel samples onto the end of the input buffer, returns where it was written*/
+void *input_interleave(input *in, const int32_t * const buffer[], size_t samples);
 void prepare_io(input *in, char *ipath, output *out, char *opath, uint8_t *header, flac_settings *set);
 
 #endif
@@ -0,0 +1,313 @@
+/* microbench - Per-call timings of flaccid hot paths
+	* init_static_encoder and simple_enc_analyse at each blocksize and compression level
+	* queue_merge and queue_tweak on a synthetic queue of fixed size frames
+	* seektable_add and seektable_write at huge frame counts
+	* input_interleave of decoded 16 and 24 bit frames, what the flac write_callback does
+	* Each benchmark is repeated until it has run for at least -t seconds, the best of -r runs is reported as ns/op
+	* Links against everything but flaccid.c, input is a deterministic synthetic 16 bit signal
+ */
+#include "common.h"
+#include "load.h"
+#include "seektable.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static double min_time=0.2;
+static int runs=5;
+
+static const int bench_blocks[]={256, 512, 1024, 1152, 2048, 4096, 4608, 8192, 16384, 32768, 65535};
+static char *bench_comps[]={"0", "3", "5", "6", "8", "8p"};
+
+#define COUNT(a) (sizeof(a)/sizeof(a[0]))
+
+/*Repeat fn(ctx, n) with growing n until it takes min_time, best ns/op of several runs*/
+static double bench_time(void (*fn)(void*, size_t), void *ctx){
+	double best=0, el, ns, start;
+	int r;
+	size_t n;
+	for(r=0;r<runs;++r){
+		for(n=1;;n*=2){
+			start=omp_get_wtime();
+			fn(ctx, n);
+			el=omp_get_wtime()-start;
+			if(el>=min_time)
+				break;
+		}
+		ns=(el*1e9)/n;
+		if(!r || ns<best)
+			best=ns;
+	}
+	return best;
+}
+
+static void report(const char *name, const char *param, double ns, double per){
+	if(per>0)
+		printf("%s\t%s\t%.1f\t%.3f\n", name, param, ns, ns/per);
+	else
+		printf("%s\t%s\t%.1f\t-\n", name, param, ns);
+	fflush(stdout);
+}
+
+typedef struct{
+	flac_settings *set;
+	input *in;
+	stats *stat;
+	queue *q;
+	simple_enc *senc;
+	char *comp;
+	int blocksize;
+	size_t frames;
+	double timed;//seconds spent in the timed part by benchmarks that exclude per-call setup
+	seektable_t st;
+	output out;
+	int32_t *chan[8];
+} bench_ctx;
+
+static void bench_init(void *ctx, size_t n){
+	bench_ctx *c=ctx;
+	size_t i;
+	for(i=0;i<n;++i)
+		FLAC__static_encoder_delete(init_static_encoder(c->set, c->blocksize, c->comp, c->set->apod_anal));
+}
+
+static void bench_encode(void *ctx, size_t n){
+	bench_ctx *c=ctx;
+	size_t i;
+	for(i=0;i<n;++i)
+		simple_enc_analyse(c->senc, c->set, c->in, c->blocksize, 0, NULL);
+}
+
+/*Fill the queue with fixed size frames all marked as new. Done outside the timer by the pass benchmarks*/
+static void queue_fill(bench_ctx *c){
+	size_t i;
+	for(i=0;i<c->frames;++i){
+		simple_enc_analyse(c->q->sq[i], c->set, c->in, c->blocksize, i*c->blocksize, NULL);
+		c->q->sq[i]->gen=1;
+	}
+	c->q->depth=c->frames;
+	c->q->gen=0;
+}
+
+static void bench_merge(void *ctx, size_t n){
+	bench_ctx *c=ctx;
+	double el=0, start;
+	size_t i;
+	for(i=0;i<n;++i){
+		queue_fill(c);
+		start=omp_get_wtime();
+		queue_merge(c->q, c->set, c->in, c->stat, 1);
+		el+=omp_get_wtime()-start;
+	}
+	c->timed=el;
+}
+
+static void bench_tweak(void *ctx, size_t n){
+	bench_ctx *c=ctx;
+	double el=0, start;
+	size_t i;
+	for(i=0;i<n;++i){
+		queue_fill(c);
+		start=omp_get_wtime();
+		queue_tweak(c->q, c->set, c->in, c->stat, 1);
+		el+=omp_get_wtime()-start;
+	}
+	c->timed=el;
+}
+
+static void bench_seek_add(void *ctx, size_t n){
+	bench_ctx *c=ctx;
+	size_t i;
+	for(i=0;i<n;++i)
+		seektable_add(&(c->st), i*4096, i*8000, 4096);
+	free(c->st.set);
+	memset(&(c->st), 0, sizeof(seektable_t));
+}
+
+static void bench_seek_write(void *ctx, size_t n){
+	bench_ctx *c=ctx;
+	double el=0, start;
+	size_t i, j;
+	for(i=0;i<n;++i){
+		memset(&(c->st), 0, sizeof(seektable_t));
+		for(j=0;j<c->frames;++j)
+			seektable_add(&(c->st), j*4096, j*8000, 4096);
+		c->st.write_cnt=932067;//most that fit in a metadata block
+		c->out.sampleloc=c->frames*4096;
+		rewind(c->out.fout);
+		start=omp_get_wtime();
+		seektable_write(&(c->st), &(c->out));
+		el+=omp_get_wtime()-start;
+	}
+	c->timed=el;
+	memset(&(c->st), 0, sizeof(seektable_t));
+}
+
+static void bench_interleave(void *ctx, size_t n){
+	bench_ctx *c=ctx;
+	size_t i;
+	for(i=0;i<n;++i)
+		input_interleave(c->in, (const int32_t * const*)c->chan, c->blocksize);
+}
+
+/*bench_time for benchmarks that exclude per-call setup, min_time applies to the timed part only*/
+static double bench_time_inner(void (*fn)(void*, size_t), bench_ctx *c){
+	double best=0, ns;
+	int r;
+	size_t n;
+	for(r=0;r<runs;++r){
+		for(n=1;;n*=2){
+			fn(c, n);
+			if(c->timed>=min_time || n>=(1<<16))
+				break;
+		}
+		ns=(c->timed*1e9)/n;
+		if(!r || ns<best)
+			best=ns;
+	}
+	return best;
+}
+
+int main(int argc, char *argv[]){
+	bench_ctx c;
+	char param[64];
+	flac_settings set;
+	input in;
+	int blocks[1]={1152}, opt, work_count=1;
+	int16_t *pcm;
+	queue q;
+	size_t b, i, j, k, samples=65536*8;
+	stats stat={0};
+	uint64_t state=0x9E3779B97F4A7C15ULL;
+	double v=0;
+
+	while((opt=getopt(argc, argv, "r:t:w:h"))!=-1){
+		switch(opt){
+			case 'r':
+				runs=atoi(optarg);
+				_if((runs<1), "Invalid -r");
+				break;
+			case 't':
+				min_time=atof(optarg);
+				_if((min_time<=0), "Invalid -t");
+				break;
+			case 'w':
+				work_count=atoi(optarg);
+				_if((work_count<1), "Invalid -w");
+				break;
+			default:
+				return printf("Usage: microbench [-r runs] [-t min_seconds] [-w workers]\n"
+				"Prints benchmark, parameters, ns/op and ns/sample (where meaningful) as tab-separated rows\n"
+				"Workers only affect queue_merge/queue_tweak\n");
+		}
+	}
+
+	memset(&set, 0, sizeof(flac_settings));
+	set.bps=16;
+	set.channels=2;
+	set.sample_rate=44100;
+	set.lax=1;
+	set.blocks=blocks;
+	set.blocks_count=1;
+	set.blocksize_limit_lower=16;
+	set.blocksize_limit_upper=65535;
+	set.comp_anal="6";
+	set.merge=1;
+	set.merge_span=4;
+	set.tweak=1;
+	set.mode=MODE_GSET;
+	set.queue_size=64;
+	set.work_count=work_count;
+	set.lpc_order_limit=32;
+	set.rice_order_limit=15;
+	set.encode_func=FLAC__static_encoder_process_frame_bps16_interleaved;
+
+	//deterministic synthetic stereo, a slow chirp over decaying noise bursts
+	pcm=malloc(samples*set.channels*sizeof(int16_t));
+	for(i=0;i<samples;++i){
+		state^=state>>12;
+		state^=state<<25;
+		state^=state>>27;
+		if(i%4410==0)
+			v=1.0;
+		for(j=0;j<(size_t)set.channels;++j)
+			pcm[(i*set.channels)+j]=(int16_t)(8000*sin((i*(1+i/65536.0)*0.05)+j)+v*(int16_t)((state*2685821657736338717ULL)>>48)/4);
+		v*=0.999;
+	}
+	memset(&in, 0, sizeof(input));
+	in.set=&set;
+	in.buf=pcm;
+	in.sample_cnt=samples;
+
+	stat.work_count=set.work_count;
+	stat.thread=aligned_alloc(_Alignof(thread_stats), sizeof(thread_stats)*set.work_count);
+	memset(stat.thread, 0, sizeof(thread_stats)*set.work_count);
+
+	memset(&c, 0, sizeof(c));
+	c.set=&set;
+	c.in=&in;
+	c.stat=&stat;
+	c.q=&q;
+	c.senc=calloc(1, sizeof(simple_enc));
+
+	printf("benchmark\tparameters\tns_per_op\tns_per_sample\n");
+	for(b=0;b<COUNT(bench_blocks);++b){
+		for(k=0;k<COUNT(bench_comps);++k){
+			c.blocksize=bench_blocks[b];
+			c.comp=bench_comps[k];
+			set.comp_anal=bench_comps[k];
+			snprintf(param, sizeof(param), "blocksize=%d comp=%s", c.blocksize, c.comp);
+			report("init_static_encoder", param, bench_time(bench_init, &c), 0);
+			report("simple_enc_analyse", param, bench_time(bench_encode, &c), c.blocksize);
+		}
+	}
+	set.comp_anal="6";
+
+	queue_alloc(&q, &set);
+	c.blocksize=1152;
+	c.frames=set.queue_size;
+	snprintf(param, sizeof(param), "frames=%zu blocksize=%d workers=%d", c.frames, c.blocksize, set.work_count);
+	report("queue_merge", param, bench_time_inner(bench_merge, &c), c.frames*c.blocksize);
+	report("queue_tweak", param, bench_time_inner(bench_tweak, &c), c.frames*c.blocksize);
+	q.depth=0;
+	queue_dealloc(&q, &set, &in, &stat, &c.out);
+
+	report("seektable_add", "growing to n", bench_time(bench_seek_add, &c), 0);
+	c.out.fout=tmpfile();
+	_if((!c.out.fout), "Could not open temporary file");
+	for(c.frames=1<<18;c.frames<=(1<<22);c.frames*=4){
+		snprintf(param, sizeof(param), "frames=%zu seekpoints=932067", c.frames);
+		report("seektable_write", param, bench_time_inner(bench_seek_write, &c), 0);
+	}
+	fclose(c.out.fout);
+
+	for(i=0;i<8;++i){
+		c.chan[i]=malloc(sizeof(int32_t)*65536);
+		for(j=0;j<65536;++j)
+			c.chan[i][j]=pcm[((j%samples)*set.channels)+(i%set.channels)];
+	}
+	in.sample_cnt=0;
+	for(set.bps=16;set.bps<=24;set.bps+=8){
+		for(set.channels=1;set.channels<=8;set.channels*=2){
+			in.buf=malloc((set.bps==16?2:4)*set.channels*65536);
+			for(b=0;b<COUNT(bench_blocks);++b){
+				c.blocksize=bench_blocks[b];
+				snprintf(param, sizeof(param), "bps=%d channels=%d blocksize=%d", set.bps, set.channels, c.blocksize);
+				report("input_interleave", param, bench_time(bench_interleave, &c), c.blocksize);
+			}
+			free(in.buf);
+		}
+	}
+
+	for(i=0;i<8;++i)
+		free(c.chan[i]);
+	simple_enc_dealloc(c.senc);
+	free(stat.thread);
+	free(stat.saved_merge);
+	free(stat.saved_tweak);
+	free(pcm);
+	return 0;
+}
@@ -1,80 +1,231 @@
+#include "estimate.h"
 #include "peakset.h"
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
-typedef struct flist flist;
-struct flist{
-	size_t blocksize, outbuf_size;
-	flist *next;
-};
+#define PEAK_SKIP UINT32_MAX//cell not encoded
+#define PEAK_INF (UINT64_MAX/4)//unreachable, small enough that adding a cell or another PEAK_INF can't overflow
 
-static void peak_window(queue *q, input *in, size_t window_size, output *out, flac_settings *set, stats *stat, simple_enc **work, size_t *step, size_t *frame_results, size_t *running_results, size_t *running_step, size_t effort){
+/* DP tables for a window. Cells are blocksize-major so every row is contiguous, rows and running costs are front
+padded by the largest step so the recurrence never needs to check for the window start */
+typedef struct{
+	uint32_t *cell;//row j at cell+(j*stride)+pad, encoded size of a frame starting at grid position i. 0 means to encode
+	uint64_t *run;//run[pad+i] cheapest path from window start to i
+	uint64_t *back;//back[i] cheapest path from i to window end (coarse pruning only)
+	uint64_t *best;//per position scratch for a block of the recurrence
+	uint16_t *choice;//choice[i] blocksize index of the last frame on the cheapest path to i
+	uint16_t *path;//traceback, blocksize indices in order
+	size_t pad, stride;
+} peak_tables;
+
+static uint32_t *peak_row(peak_tables *t, size_t j){
+	return t->cell+(j*t->stride)+t->pad;
+}
+
+/* mark which cells of the window get a real analysis encode, 0 to encode, PEAK_SKIP to skip
+With screening the smallest blocksize is always encoded so that a path through the window exists */
+static void peak_screen(input *in, size_t window_size, size_t grid, flac_settings *set, size_t *step, peak_tables *t, estimator *est){
+	double best, *esteff;
+	size_t i, j, k, pick;
+	if(!set->screen || (size_t)set->screen>=set->blocks_count){
+		for(j=0;j<set->blocks_count;++j)
+			memset(peak_row(t, j), 0, sizeof(uint32_t)*window_size);
+		return;
+	}
+	est_build(est, set, in, in->loc_analysis, window_size*grid, grid);
+	esteff=malloc(sizeof(double)*set->blocks_count);
+	for(i=0;i<window_size;++i){
+		for(j=0;j<set->blocks_count;++j){
+			peak_row(t, j)[i]=PEAK_SKIP;
+			if(i<window_size-(step[j]-1))
+				esteff[j]=((double)est_frame(est, set, in->loc_analysis+(grid*i), set->blocks[j]))/set->blocks[j];
+			else
+				esteff[j]=9999.0;
+		}
+		peak_row(t, 0)[i]=0;
+		esteff[0]=9999.0;
+		for(k=1;k<(size_t)set->screen;++k){
+			best=9998.0;
+			pick=0;
+			for(j=1;j<set->blocks_count;++j){
+				if(esteff[j]<best){
+					best=esteff[j];
+					pick=j;
+				}
+			}
+			if(!pick)
+				break;
+			peak_row(t, pick)[i]=0;
+			esteff[pick]=9999.0;
+		}
+	}
+	free(esteff);
+}
+
+/* skip cells no path from window start to window end can use. reach[i] is set if grid position i can be
+reached from the window start, coreach is filled here for the window end */
+static void peak_reach(size_t window_size, flac_settings *set, size_t *step, peak_tables *t, uint8_t *reach, uint8_t *coreach){
+	size_t i, j;
+	uint32_t *row;
+	coreach[window_size]=1;
+	for(i=window_size;i-->0;){
+		coreach[i]=0;
+		for(j=0;j<set->blocks_count;++j)
+			coreach[i]|=(i+step[j]<=window_size)?coreach[i+step[j]]:0;
+	}
+	for(j=0;j<set->blocks_count;++j){
+		row=peak_row(t, j);
+		for(i=0;i<window_size;++i){
+			if(!reach[i] || i+step[j]>window_size || !coreach[i+step[j]])
+				row[i]=PEAK_SKIP;
+		}
+	}
+}
+
+/* fill the cells not screened out with cheap coarse sizes */
+static void peak_coarse(input *in, size_t window_size, size_t grid, flac_settings *set, stats *stat, simple_enc **work, size_t *step, peak_tables *t, estimator *est){
+	double tr;
+	size_t i, j;
+	uint32_t *row;
+	int use_est=strcmp(set->comp_coarse, "est")==0;
+	if(use_est)
+		est_build(est, set, in, in->loc_analysis, window_size*grid, grid);
+	for(j=0;j<set->blocks_count;++j){
+		row=peak_row(t, j);
+		tr=trace_now(set->trace);
+		#pragma omp parallel for num_threads(set->work_count)
+		for(i=0;i<window_size-(step[j]-1);++i){
+			if(row[i]==PEAK_SKIP)//screened out
+				continue;
+			if(use_est)
+				row[i]=est_frame(est, set, in->loc_analysis+(grid*i), set->blocks[j]);
+			else{
+				simple_enc_coarse(work[omp_get_thread_num()], set, in, set->blocks[j], in->loc_analysis+(grid*i), stat);
+				row[i]=work[omp_get_thread_num()]->outbuf_size;
+			}
+		}
+		#pragma omp barrier
+		trace_barrier(set->trace, tr);
+	}
+}
+
+/* cheapest path from window start to every position, PEAK_INF if a pruned grid can't reach it
+Positions less than step[0] apart don't depend on each other, so they're done step[0] at a time with the blocksize
+loop outside, leaving a branchless min-plus over contiguous memory the compiler can vectorise */
+static void peak_forward(size_t window_size, flac_settings *set, size_t *step, peak_tables *t){
+	size_t base, i, j, n;
+	uint64_t *best=t->best, *run=t->run+t->pad, v;
+	uint16_t *choice=t->choice;
+	const uint64_t *r;
+	const uint32_t *c;
+	run[0]=0;
+	for(base=1;base<=window_size;base+=step[0]){
+		n=(window_size-base+1)<step[0]?(window_size-base+1):step[0];
+		for(i=0;i<n;++i){
+			best[i]=PEAK_INF;
+			choice[base+i]=set->blocks_count;
+		}
+		for(j=0;j<set->blocks_count;++j){
+			r=run+base-step[j];
+			c=peak_row(t, j)+base-step[j];
+			for(i=0;i<n;++i){
+				v=r[i]+(c[i]==PEAK_SKIP?PEAK_INF:c[i]);
+				choice[base+i]=v<best[i]?j:choice[base+i];
+				best[i]=v<best[i]?v:best[i];
+			}
+		}
+		for(i=0;i<n;++i)
+			run[base+i]=best[i];
+	}
+	assert(run[window_size]<PEAK_INF);
+}
+
+/* keep only cells on a coarse path within coarse_tol bytes of the best, marked 0 for a real analysis encode.
+An absolute slack rather than relative as a window can be minutes long and any local detour would fit in a percentage */
+static void peak_prune(size_t window_size, flac_settings *set, size_t *step, peak_tables *t){
+	size_t i, j;
+	uint32_t *row;
+	uint64_t *back=t->back, limit, *run=t->run+t->pad, v;
+	back[window_size]=0;
+	for(i=window_size;i-->0;){
+		back[i]=PEAK_INF;
+		for(j=0;j<set->blocks_count;++j){
+			if(peak_row(t, j)[i]==PEAK_SKIP)
+				continue;
+			v=peak_row(t, j)[i]+back[i+step[j]];
+			back[i]=v<back[i]?v:back[i];
+		}
+	}
+	assert(back[0]==run[window_size]);
+	limit=run[window_size]+set->coarse_tol;
+	for(j=0;j<set->blocks_count;++j){
+		row=peak_row(t, j);
+		for(i=0;i<window_size;++i){
+			if(row[i]==PEAK_SKIP)
+				continue;
+			row[i]=(run[i]+row[i]+back[i+step[j]])>limit?PEAK_SKIP:0;
+		}
+	}
+}
+
+static void peak_window(queue *q, input *in, size_t window_size, size_t grid, uint8_t *reach, uint8_t *coreach, output *out, flac_settings *set, stats *stat, simple_enc **work, size_t *step, peak_tables *t, size_t effort, estimator *est){
 	simple_enc *a;
-	size_t frame_at, i, j, print_effort=0, window_size_check=0;
-	flist *frame=NULL, *frame_curr, *frame_next;
+	double tr;
+	size_t i, j, path_cnt=0, print_effort=0, window_size_check=0;
+	uint32_t *row;
+
+	peak_screen(in, window_size, grid, set, step, t, est);
+	peak_reach(window_size, set, step, t, reach, coreach);
+
+	if(set->comp_coarse){/* coarse tier prunes the grid down to finalists */
+		peak_coarse(in, window_size, grid, set, stat, work, step, t, est);
+		peak_forward(window_size, set, step, t);
+		peak_prune(window_size, set, step, t);
+	}
 
 	/* process frames for stats */
 	for(j=0;j<set->blocks_count;++j){
+		row=peak_row(t, j);
+		tr=trace_now(set->trace);
 		#pragma omp parallel for num_threads(set->work_count)
 		for(i=0;i<window_size-(step[j]-1);++i){
-			simple_enc_analyse(work[omp_get_thread_num()], set, in, set->blocks[j], in->loc_analysis+(set->blocks[0]*i), stat);
-			frame_results[(i*set->blocks_count)+j]=work[omp_get_thread_num()]->outbuf_size;
+			if(row[i]==PEAK_SKIP)//screened out
+				continue;
+			simple_enc_analyse(work[omp_get_thread_num()], set, in, set->blocks[j], in->loc_analysis+(grid*i), stat);
+			assert(work[omp_get_thread_num()]->outbuf_size<PEAK_SKIP);
+			row[i]=work[omp_get_thread_num()]->outbuf_size;
 		}
 		#pragma omp barrier
-		for(i=window_size-(step[j]-1);i<window_size;++i)
-			frame_results[(i*set->blocks_count)+j]=SIZE_MAX;
+		trace_barrier(set->trace, tr);
 		print_effort+=step[j];
 		fprintf(stderr, "Processed %zu/%zu\n", print_effort, effort);
+		progress_report(set, stat, in, in->loc_analysis+(((uint64_t)window_size)*grid*print_effort)/effort);
 	}
 
 	/* analyse stats */
-	running_results[0]=0;
-	for(i=1;i<=window_size;++i){
-		size_t curr_run=SIZE_MAX, curr_step=set->blocks_count;
-		for(j=0;j<set->blocks_count;++j){
-			if(step[j]>i)//near the beginning we need to ensure we don't go beyond window start
-				break;
-			if(curr_run>(running_results[i-step[j]]+frame_results[((i-step[j])*set->blocks_count)+j])){
-				assert(frame_results[((i-step[j])*set->blocks_count)+j]!=SIZE_MAX);
-				curr_run=(running_results[i-step[j]]+frame_results[((i-step[j])*set->blocks_count)+j]);
-				curr_step=j;
-			}
-		}
-		assert(curr_run!=SIZE_MAX);
-		running_results[i]=curr_run;
-		running_step[i]=curr_step;
-	}
+	peak_forward(window_size, set, step, t);
 
-	/* traverse optimal result */
-	for(i=window_size;i>0;){
-		frame_at=i-step[running_step[i]];
-		frame_curr=frame;
-		frame=malloc(sizeof(flist));
-		frame->blocksize=set->blocks[running_step[i]];
-		frame->next=frame_curr;
-		frame->outbuf_size=frame_results[(frame_at*set->blocks_count)+running_step[i]];
-		window_size_check+=step[running_step[i]];
-		i-=step[running_step[i]];
+	/* traverse optimal result back to front, then output front to back */
+	for(i=window_size;i>0;i-=step[t->choice[i]]){
+		assert(t->choice[i]<set->blocks_count);
+		t->path[path_cnt++]=t->choice[i];
+		window_size_check+=step[t->choice[i]];
 	}
 	assert(i==0);
 	assert(window_size_check==window_size);
 
 	//use simple_enc to encode
 	a=calloc(1, sizeof(simple_enc));
-	for(frame_curr=frame;frame_curr;frame_curr=frame_curr->next){
-		a->sample_cnt=frame_curr->blocksize;
-		assert(a->sample_cnt);
+	for(i=0;path_cnt--;i+=step[j]){
+		j=t->path[path_cnt];
+		a->sample_cnt=set->blocks[j];
 		a->curr_sample=in->loc_analysis;
-		a->outbuf_size=frame_curr->outbuf_size;
+		a->outbuf_size=peak_row(t, j)[i];
 		a=simple_enc_out(q, a, set, in, stat, out);
 	}
 	simple_enc_dealloc(a);
-
-	for(frame_curr=frame;frame_curr;frame_curr=frame_next){
-		frame_next=frame_curr->next;
-		free(frame_curr);
-	}
 }
 
 int peak_main(input *in, output *out, flac_settings *set){
@@ -82,27 +233,49 @@ int peak_main(input *in, output *out, flac_settings *set){
 	queue q;
 	stats stat={0};
 
+	estimator est={0};
+	peak_tables t={0};
 	simple_enc **work;
-	size_t effort=0, *frame_results, i, max_window_size, *running_results, *running_step, *step, this_window_size;
+	size_t effort=0, grid, i, j, max_window_size, *step, this_window_size;
+	uint8_t *coreach, *reach;
 
-	mode_boilerplate_init(set, &cstart, &q, &stat);
+	mode_boilerplate_init(set, &cstart, &q, &stat, in);
 
 	_if((set->blocks_count==1), "At least two blocksizes must be available");
-	for(i=1;i<set->blocks_count;++i)
-		_if((set->blocks[i]%set->blocks[0]), "All blocksizes must be a multiple of the minimum blocksize");
 
-	max_window_size=(set->peakset_window*1000000)/set->blocks[0];
+	//the DP runs on a grid at the GCD of the list, with lists of multiples of blocks[0] that's blocks[0] as before
+	grid=blocksize_gcd(set);
+	max_window_size=(set->peakset_window*1000000)/grid;
 
 	step=malloc(sizeof(size_t)*set->blocks_count);
 	for(i=0;i<set->blocks_count;++i)
-		step[i]=set->blocks[i]/set->blocks[0];
+		step[i]=set->blocks[i]/grid;
+
+	reach=calloc(max_window_size+1, 1);
+	coreach=malloc(max_window_size+1);
+	reach[0]=1;
+	for(i=1;i<=max_window_size;++i){
+		for(j=0;j<set->blocks_count && !reach[i];++j)
+			reach[i]=(step[j]<=i)?reach[i-step[j]]:0;
+	}
 
 	for(i=0;i<set->blocks_count;++i)
 		effort+=step[i];
 
-	frame_results=malloc(sizeof(size_t)*set->blocks_count*(max_window_size+1));
-	running_results=malloc(sizeof(size_t)*(max_window_size+1));
-	running_step=malloc(sizeof(size_t)*(max_window_size+1));
+	t.pad=step[set->blocks_count-1];
+	t.stride=t.pad+max_window_size+1;
+	t.cell=malloc(sizeof(uint32_t)*set->blocks_count*t.stride);
+	for(j=0;j<set->blocks_count;++j){
+		for(i=0;i<t.pad;++i)
+			t.cell[(j*t.stride)+i]=PEAK_SKIP;
+	}
+	t.run=malloc(sizeof(uint64_t)*t.stride);
+	for(i=0;i<t.pad;++i)
+		t.run[i]=PEAK_INF;
+	t.back=set->comp_coarse?malloc(sizeof(uint64_t)*(max_window_size+1)):NULL;
+	t.best=malloc(sizeof(uint64_t)*step[0]);
+	t.choice=malloc(sizeof(uint16_t)*(max_window_size+1));
+	t.path=malloc(sizeof(uint16_t)*((max_window_size/step[0])+1));
 
 	work=calloc(set->work_count, sizeof(simple_enc*));
 	for(i=0;i<set->work_count;++i)
@@ -110,15 +283,28 @@ int peak_main(input *in, output *out, flac_settings *set){
 
 	set->diff_comp_settings=set->diff_comp_settings?1:2;//hack as analysis not stored
 
-	while(in->input_read(in, max_window_size*set->blocks[0])>=set->blocks[0]){//for all peak windows
-		this_window_size=(in->sample_cnt/set->blocks[0])>max_window_size?max_window_size:(in->sample_cnt/set->blocks[0]);
-		peak_window(&q, in, this_window_size, out, set, &stat, work, step, frame_results, running_results, running_step, effort);
+	while(in->input_read(in, max_window_size*grid)>=(size_t)set->blocks[0]){//for all peak windows
+		this_window_size=(in->sample_cnt/grid)>max_window_size?max_window_size:(in->sample_cnt/grid);
+		//window has to end somewhere a path can reach, with screening one made from the smallest blocksize alone
+		while(!reach[this_window_size] || (set->screen && (size_t)set->screen<set->blocks_count && this_window_size%step[0]))
+			--this_window_size;
+		peak_window(&q, in, this_window_size, grid, reach, coreach, out, set, &stat, work, step, &t, effort, &est);
 	}
 	simple_enc_eof(&q, work, set, in, in->sample_cnt+1, &stat, out);//partial last frame
 
 	for(i=0;i<set->work_count;++i)
 		simple_enc_dealloc(work[i]);
 	free(work);
+	free(step);
+	free(reach);
+	free(coreach);
+	free(t.cell);
+	free(t.run);
+	free(t.back);
+	free(t.best);
+	free(t.choice);
+	free(t.path);
+	est_dealloc(&est);
 
 	mode_boilerplate_finish(set, &cstart, &q, &stat, in, out);
 	set->diff_comp_settings=set->diff_comp_settings==2?0:1;//reverse hack just in case
@@ -0,0 +1,108 @@
+#include "report.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+static void json_str(FILE *f, char *key, char *val){
+	fprintf(f, "\"%s\":", key);
+	if(!val){
+		fprintf(f, "null,");
+		return;
+	}
+	fputc('"', f);
+	for(;*val;++val){
+		if(*val=='"' || *val=='\\')
+			fputc('\\', f);
+		if((unsigned char)*val>=32)
+			fputc(*val, f);
+	}
+	fprintf(f, "\",");
+}
+
+static void json_u64s(FILE *f, char *key, uint64_t *v, size_t cnt, int last){
+	size_t i;
+	fprintf(f, "\"%s\":[", key);
+	for(i=0;i<cnt;++i)
+		fprintf(f, "%s%"PRIu64, i?",":"", v[i]);
+	fprintf(f, "]%s", last?"":",");
+}
+
+/*one thread_stats member across all threads, member is its offsetof*/
+static void json_threads(FILE *f, char *key, stats *stat, size_t member, int last){
+	size_t i;
+	fprintf(f, "\"%s\":[", key);
+	for(i=0;i<stat->work_count;++i)
+		fprintf(f, "%s%"PRIu64, i?",":"", *(uint64_t*)(((uint8_t*)(stat->thread+i))+member));
+	fprintf(f, "]%s", last?"":",");
+}
+
+void report_json(char *path, flac_settings *set, stats *stat, input *in, size_t outsize){
+	FILE *f;
+	size_t i, first, j;
+	struct rusage ru;
+	thread_stats tot;
+	double wall;
+
+	f=fopen(path, "w");
+	_if((!f), "Could not open --stats-json file");
+
+	fprintf(f, "{\"settings\":{");
+	json_str(f, "mode", mode_name(set->mode));
+	json_str(f, "analysis_comp", set->comp_anal);
+	json_str(f, "analysis_apod", set->apod_anal);
+	json_str(f, "output_comp", set->comp_output);
+	json_str(f, "output_apod", set->apod_output);
+	json_str(f, "outputalt_comp", set->comp_outputalt);
+	json_str(f, "outputalt_apod", set->apod_outputalt);
+	fprintf(f, "\"blocksizes\":[");
+	for(i=0;i<set->blocks_count;++i)
+		fprintf(f, "%s%d", i?",":"", set->blocks[i]);
+	fprintf(f, "],\"lax\":%d,\"outperc\":%d,\"tweak\":%d,\"merge\":%d,\"merge_span\":%d,\"resegment\":%d,", set->lax, set->outperc, set->tweak, set->merge, set->merge_span, set->resegment);
+	fprintf(f, "\"queue\":%d,\"queue_overlap\":%d,\"workers\":%d,\"blocksize_limit_lower\":%d,\"blocksize_limit_upper\":%d,", set->queue_size, set->queue_overlap, set->work_count, set->blocksize_limit_lower, set->blocksize_limit_upper);
+	fprintf(f, "\"screen\":%d,\"segments\":%d,\"peakset_window\":%d,\"beam\":%d,\"transient_db\":%d,\"transient_verify\":%d},", set->screen, set->segments, set->peakset_window, set->beam, set->transient_db, set->transient_verify);
+
+	fprintf(f, "\"input\":{\"samples\":%"PRIu64",\"sample_rate\":%d,\"channels\":%d,\"bps\":%d},", in->loc_analysis, set->sample_rate, set->channels, set->bps);
+	fprintf(f, "\"size\":%zu,\"cpu_time\":%.6f,\"wall_time\":%.6f,", outsize, stat->cpu_time, stat->wall_time);
+
+	//cpu is summed over threads with thread_cpu giving each thread's share, all in seconds
+	stats_total(stat, &tot);
+	fprintf(f, "\"phases\":{");
+	for(i=0;i<PHASE_COUNT;++i){
+		wall=stat->phase_wall[i];
+		fprintf(f, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f,\"thread_cpu\":[", i?",":"", phase_name(i), wall, tot.phase_cpu[i]/1e9);
+		for(j=0;j<stat->work_count;++j)
+			fprintf(f, "%s%.6f", j?",":"", stat->thread[j].phase_cpu[i]/1e9);
+		fprintf(f, "],\"samples_per_sec\":%.1f,\"realtime\":%.3f}", wall>0?in->loc_analysis/wall:0, wall>0?(((double)in->loc_analysis)/set->sample_rate)/wall:0);
+	}
+	fprintf(f, "},");
+
+	//samples encoded by each thread
+	fprintf(f, "\"effort\":{");
+	json_threads(f, "analysis", stat, offsetof(thread_stats, effort_anal), 0);
+	json_threads(f, "output", stat, offsetof(thread_stats, effort_output), 0);
+	json_threads(f, "tweak", stat, offsetof(thread_stats, effort_tweak), 0);
+	json_threads(f, "merge", stat, offsetof(thread_stats, effort_merge), 0);
+	json_threads(f, "resegment", stat, offsetof(thread_stats, effort_reseg), 1);
+	fprintf(f, "},");
+	json_threads(f, "encodes", stat, offsetof(thread_stats, encodes), 0);
+
+	fprintf(f, "\"frames\":{");//blocksize histogram
+	for(i=0, first=1;i<65536;++i){
+		if(stat->blocksize_hist[i]){
+			fprintf(f, "%s\"%zu\":%"PRIu64, first?"":",", i, stat->blocksize_hist[i]);
+			first=0;
+		}
+	}
+	fprintf(f, "},");
+
+	//bytes saved by the nth pass of each flush, summed over flushes
+	fprintf(f, "\"passes\":{");
+	json_u64s(f, "merge", stat->saved_merge, stat->passes_merge, 0);
+	json_u64s(f, "tweak", stat->saved_tweak, stat->passes_tweak, 1);
+	fprintf(f, "},");
+
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(f, "\"peak_rss_kb\":%ld}\n", ru.ru_maxrss);
+	fclose(f);
+}
@@ -0,0 +1,11 @@
+/*Machine-readable run report*/
+#ifndef REPORT
+#define REPORT
+
+#include "common.h"
+
+/*Write settings, phase timings, per-thread effort, the blocksize histogram, merge/tweak savings per pass and peak
+RSS as a JSON object to path*/
+void report_json(char *path, flac_settings *set, stats *stat, input *in, size_t outsize);
+
+#endif
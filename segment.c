@@ -0,0 +1,127 @@
+#include "segment.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+void segment_add(seg_frames *fr, uint64_t curr_sample, size_t sample_cnt, size_t outbuf_size){
+	if(fr->cnt==fr->alloc){
+		fr->alloc=fr->alloc?fr->alloc*2:64;
+		fr->frame=realloc(fr->frame, sizeof(seg_frame)*fr->alloc);
+	}
+	fr->frame[fr->cnt].curr_sample=curr_sample;
+	fr->frame[fr->cnt].sample_cnt=sample_cnt;
+	fr->frame[fr->cnt].outbuf_size=outbuf_size;
+	++fr->cnt;
+}
+
+/*Sum of squares of samples [curr_sample, curr_sample+samples)*/
+static double segment_energy(flac_settings *set, input *in, uint64_t curr_sample, size_t samples){
+	double r=0;
+	size_t i, n=samples*set->channels;
+	int16_t *raw16;
+	int32_t *raw32;
+	if(set->bps==16){
+		raw16=((int16_t*)in->buf)+((curr_sample-in->loc_buffer)*set->channels);
+		for(i=0;i<n;++i)
+			r+=((double)raw16[i])*raw16[i];
+	}
+	else{
+		raw32=((int32_t*)in->buf)+((curr_sample-in->loc_buffer)*set->channels);
+		for(i=0;i<n;++i)
+			r+=((double)raw32[i])*raw32[i];
+	}
+	return r;
+}
+
+/*Move a nominal boundary to the quietest blocks[0]-aligned point within an eighth of a segment either side*/
+static uint64_t segment_boundary(flac_settings *set, input *in, uint64_t nominal, size_t segment_len, uint64_t lo, uint64_t hi){
+	double best=-1.0, e;
+	size_t span=(segment_len/8)/set->blocks[0];
+	uint64_t cand, r=nominal;
+	int64_t d;
+	for(d=-(int64_t)span;d<=(int64_t)span;++d){
+		cand=nominal+(d*set->blocks[0]);
+		if(cand<=lo || cand+set->blocks[0]>hi)
+			continue;
+		e=segment_energy(set, in, cand-(set->blocks[0]/2), set->blocks[0]);//window centred on the candidate split
+		if(best<0 || e<best){
+			best=e;
+			r=cand;
+		}
+	}
+	return r;
+}
+
+int segment_main(input *in, output *out, flac_settings *set, segment_func analyse, size_t segment_len){
+	clock_t cstart;
+	queue q;
+	stats stat={0};
+
+	simple_enc *a;
+	seg_frames *fr;
+	double tr;
+	size_t i, j, nseg;
+	uint64_t *bound, end;
+	int eof;
+
+	mode_boilerplate_init(set, &cstart, &q, &stat, in);
+
+	segment_len-=segment_len%set->blocks[0];
+	assert(segment_len);
+	fr=calloc(set->segments, sizeof(seg_frames));
+	bound=malloc(sizeof(uint64_t)*(set->segments+1));
+	a=calloc(1, sizeof(simple_enc));
+	set->diff_comp_settings=set->diff_comp_settings?1:2;//hack as analysis not stored
+
+	while(in->input_read(in, (set->segments*segment_len)+(segment_len/8)+set->blocks[0])){
+		//when input is short of a full batch we've hit eof, split what's left evenly and analyse it all
+		eof=in->sample_cnt<(set->segments*segment_len)+(segment_len/8)+set->blocks[0];
+		end=in->loc_analysis+in->sample_cnt;
+		nseg=set->segments;
+		if(eof){
+			nseg=in->sample_cnt/segment_len;
+			nseg=nseg<1?1:(nseg>(size_t)set->segments?(size_t)set->segments:nseg);
+		}
+		bound[0]=in->loc_analysis;
+		for(i=1;i<=nseg;++i){
+			if(eof && i==nseg)
+				bound[i]=end;
+			else{
+				bound[i]=in->loc_analysis+(i*(eof?((in->sample_cnt/nseg)-((in->sample_cnt/nseg)%set->blocks[0])):segment_len));
+				bound[i]=segment_boundary(set, in, bound[i], segment_len, bound[i-1], end);
+			}
+		}
+
+		tr=trace_now(set->trace);
+		#pragma omp parallel for num_threads(set->work_count) schedule(dynamic)
+		for(i=0;i<nseg;++i){
+			fr[i].cnt=0;
+			analyse(fr+i, set, in, bound[i], bound[i+1]-bound[i], &stat);
+		}
+		#pragma omp barrier
+		trace_barrier(set->trace, tr);
+
+		//stitch segments into the queue in order
+		for(i=0;i<nseg;++i){
+			for(j=0;j<fr[i].cnt;++j){
+				assert(fr[i].frame[j].curr_sample==in->loc_analysis);
+				a->sample_cnt=fr[i].frame[j].sample_cnt;
+				a->curr_sample=fr[i].frame[j].curr_sample;
+				a->outbuf_size=fr[i].frame[j].outbuf_size;
+				a=simple_enc_out(&q, a, set, in, &stat, out);
+			}
+		}
+		if(eof)
+			break;
+	}
+
+	mode_boilerplate_finish(set, &cstart, &q, &stat, in, out);
+	set->diff_comp_settings=set->diff_comp_settings==2?0:1;//reverse hack just in case
+
+	simple_enc_dealloc(a);
+	for(i=0;i<(size_t)set->segments;++i)
+		free(fr[i].frame);
+	free(fr);
+	free(bound);
+	return 0;
+}
@@ -0,0 +1,31 @@
+/*Segment-parallel analysis. Input is split into independent segments at low energy points so that modes which are
+inherently sequential (each frame starts where the previous ended) can analyse several segments concurrently*/
+#ifndef SEGMENT
+#define SEGMENT
+
+#include "common.h"
+
+/*nominal segment length in multiples of the largest blocksize in the list*/
+#define SEGMENT_BLOCKS 128
+
+typedef struct{
+	uint64_t curr_sample;
+	size_t sample_cnt, outbuf_size;
+} seg_frame;
+
+/*frames chosen for a segment, in order*/
+typedef struct{
+	seg_frame *frame;
+	size_t cnt, alloc;
+} seg_frames;
+
+void segment_add(seg_frames *fr, uint64_t curr_sample, size_t sample_cnt, size_t outbuf_size);
+
+/*A sequential analysis of the input range [curr_sample, curr_sample+samples), must add frames covering the entire range
+Only the final segment of input can have a length that isn't a multiple of blocks[0]*/
+typedef void (*segment_func)(seg_frames *fr, flac_settings *set, input *in, uint64_t curr_sample, size_t samples, stats *stat);
+
+/*Drive a mode over --segments concurrent segments, stitching the results into the output queue in order*/
+int segment_main(input *in, output *out, flac_settings *set, segment_func analyse, size_t segment_len);
+
+#endif
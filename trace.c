@@ -0,0 +1,88 @@
+#include "trace.h"
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+trace *trace_open(char *path, size_t work_count){
+	size_t i;
+	trace *t=calloc(1, sizeof(trace));
+	t->path=path;
+	t->work_count=work_count;
+	t->thread=malloc(sizeof(trace_thread*)*work_count);
+	for(i=0;i<work_count;++i)
+		t->thread[i]=calloc(1, sizeof(trace_thread));//separate allocations so threads don't share cache lines
+	t->epoch=omp_get_wtime();
+	return t;
+}
+
+double trace_now(trace *t){
+	return t?omp_get_wtime():0;
+}
+
+static void trace_push(trace_thread *th, const char *name, double ts, double dur, uint64_t curr_sample, uint64_t samples){
+	if(th->cnt==th->alloc){
+		th->alloc=th->alloc?th->alloc*2:4096;
+		th->ev=realloc(th->ev, sizeof(trace_event)*th->alloc);
+	}
+	th->ev[th->cnt].name=name;
+	th->ev[th->cnt].ts=ts;
+	th->ev[th->cnt].dur=dur;
+	th->ev[th->cnt].curr_sample=curr_sample;
+	th->ev[th->cnt].samples=samples;
+	++th->cnt;
+}
+
+void trace_add(trace *t, const char *name, double start, uint64_t curr_sample, uint64_t samples){
+	trace_thread *th;
+	double end;
+	if(!t)
+		return;
+	end=omp_get_wtime();
+	th=t->thread[omp_get_thread_num()];
+	trace_push(th, name, start-t->epoch, end-start, curr_sample, samples);
+	th->busy=end;
+}
+
+void trace_barrier(trace *t, double start){
+	size_t i;
+	double end, from;
+	if(!t)
+		return;
+	end=omp_get_wtime();
+	for(i=0;i<t->work_count;++i){//the region has ended so every buffer is safe to touch from here
+		from=t->thread[i]->busy>start?t->thread[i]->busy:start;
+		if(end>from)
+			trace_push(t->thread[i], "barrier", from-t->epoch, end-from, 0, 0);
+		t->thread[i]->busy=end;
+	}
+}
+
+void trace_close(trace *t){
+	FILE *f;
+	size_t i, j, first=1;
+	trace_event *e;
+	if(!t)
+		return;
+	f=fopen(t->path, "w");
+	_if((!f), "Could not open --trace file");
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for(i=0;i<t->work_count;++i){
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%zu,\"args\":{\"name\":\"worker %zu\"}}", first?"":",\n", i, i);
+		first=0;
+		for(j=0;j<t->thread[i]->cnt;++j){
+			e=t->thread[i]->ev+j;
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f", e->name, i, e->ts*1e6, e->dur*1e6);
+			if(e->samples)
+				fprintf(f, ",\"args\":{\"sample\":%"PRIu64",\"samples\":%"PRIu64"}", e->curr_sample, e->samples);
+			fprintf(f, "}");
+		}
+		free(t->thread[i]->ev);
+		free(t->thread[i]);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	free(t->thread);
+	free(t);
+}
@@ -0,0 +1,43 @@
+/*Chrome trace event export of worker activity, viewable in chrome://tracing or Perfetto. Every function does
+nothing if the trace is NULL so call sites don't need to check*/
+#ifndef TRACE
+#define TRACE
+
+#include <inttypes.h>
+#include <stddef.h>
+
+typedef struct{
+	const char *name;
+	double ts, dur;//seconds since the trace was opened
+	uint64_t curr_sample, samples;
+} trace_event;
+
+/*events recorded by one thread, only that thread appends to it*/
+typedef struct{
+	trace_event *ev;
+	size_t cnt, alloc;
+	double busy;//end of the last event, where any barrier wait starts
+} trace_thread;
+
+typedef struct{
+	char *path;
+	trace_thread **thread;
+	size_t work_count;
+	double epoch;
+} trace;
+
+trace *trace_open(char *path, size_t work_count);
+
+/*Timestamp to pass as start to trace_add/trace_barrier, 0 if not tracing*/
+double trace_now(trace *t);
+
+/*Record an event on the calling thread from start until now*/
+void trace_add(trace *t, const char *name, double start, uint64_t curr_sample, uint64_t samples);
+
+/*Call after a parallel region that began at start, records how long each thread waited at its closing barrier*/
+void trace_barrier(trace *t, double start);
+
+/*Write the trace file and free everything*/
+void trace_close(trace *t);
+
+#endif
@@ -0,0 +1,223 @@
+#include "transient.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+/*read batch in multiples of the largest blocksize in the list*/
+#define TRANSIENT_BATCH 64
+
+typedef struct{
+	uint64_t curr_sample;
+	size_t sample_cnt, outbuf_size;
+	int onset;//frame starts at a detected transient
+} tframe;
+
+typedef struct{
+	tframe *frame;
+	size_t cnt, alloc;
+} tframes;
+
+static void transient_add(tframes *fr, uint64_t curr_sample, size_t sample_cnt, int onset){
+	if(fr->cnt==fr->alloc){
+		fr->alloc=fr->alloc?fr->alloc*2:64;
+		fr->frame=realloc(fr->frame, sizeof(tframe)*fr->alloc);
+	}
+	fr->frame[fr->cnt].curr_sample=curr_sample;
+	fr->frame[fr->cnt].sample_cnt=sample_cnt;
+	fr->frame[fr->cnt].outbuf_size=0;
+	fr->frame[fr->cnt].onset=onset;
+	++fr->cnt;
+}
+
+/*Per-granule energy and energy of the first difference (a cheap stand-in for high frequency content) over all channels*/
+static void transient_features(flac_settings *set, input *in, size_t granule, size_t granules, double *energy, double *flux){
+	double d, e, f, tr;
+	size_t i, k, n=granule*set->channels;
+	int16_t *raw16;
+	int32_t *raw32;
+	tr=trace_now(set->trace);
+	#pragma omp parallel for num_threads(set->work_count) private(d, e, f, i, raw16, raw32)
+	for(k=0;k<granules;++k){
+		e=0;
+		f=0;
+		if(set->bps==16){
+			raw16=((int16_t*)in->buf)+((in->loc_analysis-in->loc_buffer+(k*granule))*set->channels);
+			for(i=0;i<n;++i)
+				e+=((double)raw16[i])*raw16[i];
+			for(i=set->channels;i<n;++i){
+				d=((double)raw16[i])-raw16[i-set->channels];
+				f+=d*d;
+			}
+		}
+		else{
+			raw32=((int32_t*)in->buf)+((in->loc_analysis-in->loc_buffer+(k*granule))*set->channels);
+			for(i=0;i<n;++i)
+				e+=((double)raw32[i])*raw32[i];
+			for(i=set->channels;i<n;++i){
+				d=((double)raw32[i])-raw32[i-set->channels];
+				f+=d*d;
+			}
+		}
+		energy[k]=e;
+		flux[k]=f;
+	}
+	#pragma omp barrier
+	trace_barrier(set->trace, tr);
+}
+
+/*Mark granules that start a new region, either an energy onset or a change in spectral tilt of at least transient_db
+A floor of a few LSB of noise stops near-silence from triggering on every granule*/
+static void transient_detect(flac_settings *set, size_t granule, size_t granules, double *energy, double *flux, uint8_t *onset){
+	double fl=ldexp(granule*set->channels, 2*(set->bps-14)), rise, tilt;
+	size_t k;
+	if(granules)
+		onset[0]=0;
+	for(k=1;k<granules;++k){
+		rise=10*log10((energy[k]+fl)/(energy[k-1]+fl));
+		tilt=10*log10(((flux[k]+fl)/(energy[k]+fl))/((flux[k-1]+fl)/(energy[k-1]+fl)));
+		onset[k]=rise>=set->transient_db || fabs(tilt)>=set->transient_db;
+	}
+}
+
+/*Fill a region with the largest blocksizes that fit. If whole==0 only whole frames of the largest blocksize are added,
+leaving the rest of the region for the next batch. Returns granules covered*/
+static size_t transient_fill(tframes *fr, flac_settings *set, size_t *step, uint64_t curr_sample, size_t granules, int onset, int whole){
+	size_t done=0, j=set->blocks_count;
+	while(j--){
+		for(;granules-done>=step[j];done+=step[j]){
+			transient_add(fr, curr_sample+(done*set->blocks[0]), set->blocks[j], onset);
+			onset=0;
+		}
+		if(!whole)
+			break;
+	}
+	return done;
+}
+
+/*Check each transient split by encoding the frames either side merged. Splits that don't pay for themselves are removed,
+a split next to one just removed is kept as the merged frame wasn't what was tested*/
+static void transient_verify(tframes *fr, flac_settings *set, input *in, simple_enc **work, size_t *merged, stats *stat){
+	double tr;
+	int joined;
+	size_t i, j;
+	tr=trace_now(set->trace);
+	#pragma omp parallel for num_threads(set->work_count) schedule(dynamic)
+	for(i=1;i<fr->cnt;++i){
+		merged[i]=SIZE_MAX;
+		if(fr->frame[i].onset && fr->frame[i-1].sample_cnt+fr->frame[i].sample_cnt<=(size_t)set->blocksize_limit_upper){
+			simple_enc_analyse(work[omp_get_thread_num()], set, in, fr->frame[i-1].sample_cnt+fr->frame[i].sample_cnt, fr->frame[i-1].curr_sample, stat);
+			merged[i]=work[omp_get_thread_num()]->outbuf_size;
+		}
+	}
+	#pragma omp barrier
+	trace_barrier(set->trace, tr);
+	for(i=1, j=0, joined=0;i<fr->cnt;++i){
+		if(!joined && merged[i]<fr->frame[j].outbuf_size+fr->frame[i].outbuf_size){
+			fr->frame[j].sample_cnt+=fr->frame[i].sample_cnt;
+			fr->frame[j].outbuf_size=merged[i];
+			joined=1;
+		}
+		else{
+			fr->frame[++j]=fr->frame[i];
+			joined=0;
+		}
+	}
+	if(fr->cnt)
+		fr->cnt=j+1;
+}
+
+int transient_main(input *in, output *out, flac_settings *set){
+	clock_t cstart;
+	queue q;
+	stats stat={0};
+
+	double *energy, *flux, tr;
+	simple_enc *a, **work;
+	tframes fr={0};
+	size_t batch, granules, i, k, *merged, start, *step;
+	uint8_t *onset;
+	int analyse, eof;
+
+	mode_boilerplate_init(set, &cstart, &q, &stat, in);
+
+	for(i=1;i<set->blocks_count;++i)
+		_if((set->blocks[i]%set->blocks[0]), "All blocksizes must be a multiple of the minimum blocksize");
+
+	step=malloc(sizeof(size_t)*set->blocks_count);
+	for(i=0;i<set->blocks_count;++i)
+		step[i]=set->blocks[i]/set->blocks[0];
+	batch=TRANSIENT_BATCH*set->blocks[set->blocks_count-1];
+	energy=malloc(sizeof(double)*(batch/set->blocks[0]));
+	flux=malloc(sizeof(double)*(batch/set->blocks[0]));
+	onset=malloc(batch/set->blocks[0]);
+	merged=malloc(sizeof(size_t)*((batch/set->blocks[0])+1));
+	work=calloc(set->work_count, sizeof(simple_enc*));
+	for(i=0;i<(size_t)set->work_count;++i)
+		work[i]=calloc(1, sizeof(simple_enc));
+	a=calloc(1, sizeof(simple_enc));
+
+	//frame sizes are only needed to verify splits or to feed queue passes, otherwise skip analysis entirely like fixed mode
+	analyse=set->transient_verify || set->merge || set->tweak || set->resegment;
+	set->diff_comp_settings=set->diff_comp_settings?1:2;//hack as analysis not stored
+
+	while(in->input_read(in, batch)){
+		eof=in->sample_cnt<batch;
+		granules=in->sample_cnt/set->blocks[0];
+		transient_features(set, in, set->blocks[0], granules, energy, flux);
+		transient_detect(set, set->blocks[0], granules, energy, flux, onset);
+
+		//propose frames, every region between transients is filled independently
+		fr.cnt=0;
+		for(start=0, k=1;k<=granules;++k){
+			if(k<granules && !onset[k])
+				continue;
+			if(k==granules && !eof){//last region may continue into the next batch
+				transient_fill(&fr, set, step, in->loc_analysis+(start*set->blocks[0]), k-start, start?1:0, 0);
+				break;
+			}
+			transient_fill(&fr, set, step, in->loc_analysis+(start*set->blocks[0]), k-start, start?1:0, 1);
+			start=k;
+		}
+		if(eof && in->sample_cnt%set->blocks[0])//partial last frame
+			transient_add(&fr, in->loc_analysis+(granules*set->blocks[0]), in->sample_cnt%set->blocks[0], 0);
+
+		if(analyse){
+			tr=trace_now(set->trace);
+			#pragma omp parallel for num_threads(set->work_count) schedule(dynamic)
+			for(i=0;i<fr.cnt;++i){
+				simple_enc_analyse(work[omp_get_thread_num()], set, in, fr.frame[i].sample_cnt, fr.frame[i].curr_sample, &stat);
+				fr.frame[i].outbuf_size=work[omp_get_thread_num()]->outbuf_size;
+			}
+			#pragma omp barrier
+			trace_barrier(set->trace, tr);
+			if(set->transient_verify)
+				transient_verify(&fr, set, in, work, merged, &stat);
+		}
+
+		for(i=0;i<fr.cnt;++i){
+			assert(fr.frame[i].curr_sample==in->loc_analysis);
+			a->sample_cnt=fr.frame[i].sample_cnt;
+			a->curr_sample=fr.frame[i].curr_sample;
+			a->outbuf_size=fr.frame[i].outbuf_size;
+			a=simple_enc_out(&q, a, set, in, &stat, out);
+		}
+		if(eof)
+			break;
+	}
+
+	mode_boilerplate_finish(set, &cstart, &q, &stat, in, out);
+	set->diff_comp_settings=set->diff_comp_settings==2?0:1;//reverse hack just in case
+
+	simple_enc_dealloc(a);
+	for(i=0;i<(size_t)set->work_count;++i)
+		simple_enc_dealloc(work[i]);
+	free(work);
+	free(energy);
+	free(flux);
+	free(onset);
+	free(merged);
+	free(step);
+	free(fr.frame);
+	return 0;
+}
@@ -0,0 +1,10 @@
+/*Transient mode implementation. Places frame boundaries directly from cheap signal features (energy onsets and changes in
+spectral tilt) instead of brute-force encoding candidates*/
+#ifndef TRANSIENT
+#define TRANSIENT
+
+#include "common.h"
+
+int transient_main(input *in, output *out, flac_settings *set);
+
+#endif